@@ -1,7 +1,8 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
+from esphome import automation
 from esphome.components import ble_client, binary_sensor, text_sensor, sensor
-from esphome.const import CONF_ID, STATE_CLASS_MEASUREMENT
+from esphome.const import CONF_ID, CONF_TRIGGER_ID, STATE_CLASS_MEASUREMENT, STATE_CLASS_TOTAL_INCREASING
 from enum import Enum, auto
 from dataclasses import dataclass
 from typing import Dict, Any
@@ -23,6 +24,18 @@ BinarySensorId = tesla_ble_vehicle_ns.enum("BinarySensorId", is_class=True)
 TextSensorId = tesla_ble_vehicle_ns.enum("TextSensorId", is_class=True)
 NumericSensorId = tesla_ble_vehicle_ns.enum("NumericSensorId", is_class=True)
 
+# Each is given the command's handle, its name, and how long it waited in the queue and then took (ms)
+COMMAND_TRIGGER_ARGS = [(cg.uint32, "handle"), (cg.std_string, "action"), (cg.uint32, "queue_wait"), (cg.uint32, "latency")]
+CommandSuccessTrigger = tesla_ble_vehicle_ns.class_(
+    "CommandSuccessTrigger", automation.Trigger.template(cg.uint32, cg.std_string, cg.uint32, cg.uint32)
+)
+CommandFailureTrigger = tesla_ble_vehicle_ns.class_(
+    "CommandFailureTrigger", automation.Trigger.template(cg.uint32, cg.std_string, cg.uint32, cg.uint32)
+)
+CommandTimeoutTrigger = tesla_ble_vehicle_ns.class_(
+    "CommandTimeoutTrigger", automation.Trigger.template(cg.uint32, cg.std_string, cg.uint32, cg.uint32)
+)
+
 @dataclass
 class SensorSpec:
     type: SensorTypes
@@ -47,6 +60,22 @@ CONF_POLL_CHARGING_PERIOD = "poll_charging_period" # Period to poll for data whe
 CONF_BLE_DISCONNECTED_MIN_TIME = "ble_disconnected_min_time" # Minimum time BLE must be disconnected before sensors are Unknown (s)
 CONF_FAST_POLL_IF_UNLOCKED = "fast_poll_if_unlocked" # if != 0, fast polls are enabled when unlocked
 CONF_WAKE_ON_BOOT = "wake_on_boot" # != 0 wakes car on device boot
+CONF_PREFER_2M_PHY = "prefer_2m_phy" # Request the 2M PHY once connected (ESP32-C3/C6/S3 and other BLE 5 chips)
+CONF_DATA_LENGTH_EXTENSION = "data_length_extension" # Request the maximum LE data length once connected
+CONF_RELIABLE_WRITES = "reliable_writes" # Confirm each chunk written and retransmit messages that aren't confirmed
+CONF_RX_TIMEOUT = "rx_timeout" # Longest gap allowed between chunks of a received message before it is dropped
+CONF_MAX_IN_FLIGHT = "max_in_flight" # Number of infotainment requests that can await a response at once
+CONF_REQUEST_RATE = "request_rate" # Sustained requests per second sent to each part of the car, cut while it reports being busy
+CONF_REQUEST_BURST = "request_burst" # Number of requests that can be sent to each part of the car back to back
+CONF_BREAKER_FAILURES = "breaker_failures" # Commands in a row given up on unanswered before only status polls are sent
+CONF_ON_COMMAND_SUCCESS = "on_command_success" # Automation run when a command asked for completes
+CONF_ON_COMMAND_FAILURE = "on_command_failure" # Automation run when a command asked for is given up on
+CONF_ON_COMMAND_TIMEOUT = "on_command_timeout" # Automation run when a command asked for runs out of time
+COMMAND_TRIGGERS = {
+    CONF_ON_COMMAND_SUCCESS: CommandSuccessTrigger,
+    CONF_ON_COMMAND_FAILURE: CommandFailureTrigger,
+    CONF_ON_COMMAND_TIMEOUT: CommandTimeoutTrigger,
+}
 
 SENSORS = {
     "is_asleep": binary (BinarySensorId.IsAsleep,
@@ -112,12 +141,38 @@ SENSORS = {
         icon = "mdi:battery-lock",),
     "last_update": text (TextSensorId.LastUpdate,
         icon = "mdi:update",),
+    "ble_circuit_breaker": text (TextSensorId.BleCircuitBreaker,
+        icon = "mdi:electric-switch",),
     "ble_disconnected_time": numeric (NumericSensorId.BleDisconnectedTime,
         icon = "mdi:bluetooth-off", device_class = sensor.DEVICE_CLASS_DURATION, unit_of_measurement = "s",),
     "charger_phases": numeric (NumericSensorId.ChargerPhases,
         icon = "mdi:surround-sound-3-1", device_class = "", state_class = STATE_CLASS_MEASUREMENT, accuracy_decimals = 0,),
     "charge_rate": numeric (NumericSensorId.ChargeRate,
         icon = "mdi:speedometer", device_class = sensor.DEVICE_CLASS_SPEED, accuracy_decimals = 0, unit_of_measurement = "mph",),
+    "ble_mtu": numeric (NumericSensorId.BleMtu,
+        icon = "mdi:bluetooth-settings", state_class = STATE_CLASS_MEASUREMENT, accuracy_decimals = 0, unit_of_measurement = "B",),
+    "ble_phy": numeric (NumericSensorId.BlePhy,
+        icon = "mdi:bluetooth-settings", state_class = STATE_CLASS_MEASUREMENT, accuracy_decimals = 0,),
+    "ble_data_length": numeric (NumericSensorId.BleDataLength,
+        icon = "mdi:bluetooth-settings", state_class = STATE_CLASS_MEASUREMENT, accuracy_decimals = 0, unit_of_measurement = "B",),
+    "ble_retransmits": numeric (NumericSensorId.BleRetransmits,
+        icon = "mdi:bluetooth-transfer", state_class = STATE_CLASS_TOTAL_INCREASING, accuracy_decimals = 0,),
+    "ble_writes_abandoned": numeric (NumericSensorId.BleWritesAbandoned,
+        icon = "mdi:bluetooth-transfer", state_class = STATE_CLASS_TOTAL_INCREASING, accuracy_decimals = 0,),
+    "ble_rx_dropped": numeric (NumericSensorId.BleRxDropped,
+        icon = "mdi:bluetooth-transfer", state_class = STATE_CLASS_TOTAL_INCREASING, accuracy_decimals = 0,),
+    "ble_vcsec_rtt": numeric (NumericSensorId.BleVcsecRtt,
+        icon = "mdi:timer-sync-outline", device_class = sensor.DEVICE_CLASS_DURATION, state_class = STATE_CLASS_MEASUREMENT, accuracy_decimals = 0, unit_of_measurement = "ms",),
+    "ble_infotainment_rtt": numeric (NumericSensorId.BleInfotainmentRtt,
+        icon = "mdi:timer-sync-outline", device_class = sensor.DEVICE_CLASS_DURATION, state_class = STATE_CLASS_MEASUREMENT, accuracy_decimals = 0, unit_of_measurement = "ms",),
+    "ble_vcsec_timeout": numeric (NumericSensorId.BleVcsecTimeout,
+        icon = "mdi:timer-alert-outline", device_class = sensor.DEVICE_CLASS_DURATION, state_class = STATE_CLASS_MEASUREMENT, accuracy_decimals = 0, unit_of_measurement = "ms",),
+    "ble_infotainment_timeout": numeric (NumericSensorId.BleInfotainmentTimeout,
+        icon = "mdi:timer-alert-outline", device_class = sensor.DEVICE_CLASS_DURATION, state_class = STATE_CLASS_MEASUREMENT, accuracy_decimals = 0, unit_of_measurement = "ms",),
+    "ble_throttle_events": numeric (NumericSensorId.BleThrottleEvents,
+        icon = "mdi:speedometer-slow", state_class = STATE_CLASS_TOTAL_INCREASING, accuracy_decimals = 0,),
+    "ble_commands_dropped": numeric (NumericSensorId.BleCommandsDropped,
+        icon = "mdi:playlist-remove", state_class = STATE_CLASS_TOTAL_INCREASING, accuracy_decimals = 0,),
 }
 
 SENSOR_TYPES_INFO = {
@@ -149,7 +204,19 @@ schema_dict = {
     cv.Optional(CONF_BLE_DISCONNECTED_MIN_TIME): cv.uint16_t,
     cv.Optional(CONF_FAST_POLL_IF_UNLOCKED): cv.uint16_t,
     cv.Optional(CONF_WAKE_ON_BOOT): cv.uint16_t,
+    cv.Optional(CONF_PREFER_2M_PHY, default=False): cv.boolean,
+    cv.Optional(CONF_DATA_LENGTH_EXTENSION, default=False): cv.boolean,
+    cv.Optional(CONF_RELIABLE_WRITES, default=False): cv.boolean,
+    cv.Optional(CONF_RX_TIMEOUT, default="1s"): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_MAX_IN_FLIGHT, default=4): cv.int_range(min=1, max=8),
+    cv.Optional(CONF_REQUEST_RATE, default=2.0): cv.float_range(min=0.1, max=50.0),
+    cv.Optional(CONF_REQUEST_BURST, default=4): cv.int_range(min=1, max=16),
+    cv.Optional(CONF_BREAKER_FAILURES, default=3): cv.int_range(min=1, max=20),
 }
+for key, trigger_class in COMMAND_TRIGGERS.items():
+    schema_dict[cv.Optional(key)] = automation.validate_automation(
+        {cv.GenerateID(CONF_TRIGGER_ID): cv.declare_id(trigger_class)}
+    )
 for key, spec in SENSORS.items():
     builder = SENSOR_TYPES_INFO[spec.type]["schema"]
     schema_dict[cv.Optional(key)] = (builder(**spec.schema_options))
@@ -177,6 +244,17 @@ async def to_code(config):
             config.get(CONF_WAKE_ON_BOOT),
         )
     )
+    cg.add(var.set_prefer_2m_phy(config[CONF_PREFER_2M_PHY]))
+    cg.add(var.set_data_length_extension(config[CONF_DATA_LENGTH_EXTENSION]))
+    cg.add(var.set_reliable_writes(config[CONF_RELIABLE_WRITES]))
+    cg.add(var.set_rx_timeout(config[CONF_RX_TIMEOUT].total_milliseconds))
+    cg.add(var.set_max_in_flight(config[CONF_MAX_IN_FLIGHT]))
+    cg.add(var.set_request_rate(config[CONF_REQUEST_RATE], config[CONF_REQUEST_BURST]))
+    cg.add(var.set_breaker_failures(config[CONF_BREAKER_FAILURES]))
+    for key in COMMAND_TRIGGERS:
+        for conf in config.get(key, []):
+            trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID], var)
+            await automation.build_automation(trigger, COMMAND_TRIGGER_ARGS, conf)
     # 🔁 Auto-register all sensors
     for key, spec in SENSORS.items():
         if key not in config:
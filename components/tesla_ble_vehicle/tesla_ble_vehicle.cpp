@@ -23,10 +23,77 @@ namespace esphome
 {
   namespace tesla_ble_vehicle
   {
+    static bool find_message_uuid(const unsigned char *message, size_t length, uint8_t *uuid)
+    /*
+    *   Finds the uuid field (51) of an encoded RoutableMessage, after its 2 byte length prefix, by stepping over the other
+    *   fields. Saves decoding the whole message just to learn which response will belong to it.
+    */
+    {
+      size_t pos = 2;
+      auto read_varint = [&](uint64_t &value) -> bool
+      {
+        value = 0;
+        for (int shift = 0; (pos < length) and (shift < 64); shift += 7)
+        {
+          uint8_t byte = message[pos++];
+          value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+          if ((byte & 0x80) == 0)
+          {
+            return true;
+          }
+        }
+        return false;
+      };
+      while (pos < length)
+      {
+        uint64_t key = 0;
+        uint64_t value = 0;
+        if (not read_varint(key))
+        {
+          return false;
+        }
+        switch (key & 0x07)
+        {
+          case PB_WT_VARINT:
+            if (not read_varint(value))
+              return false;
+            break;
+          case PB_WT_64BIT:
+            pos += 8;
+            break;
+          case PB_WT_32BIT:
+            pos += 4;
+            break;
+          case PB_WT_STRING:
+            if (not read_varint(value) or (value > length - pos))
+              return false;
+            if (((key >> 3) == UniversalMessage_RoutableMessage_uuid_tag) and (value == 16))
+            {
+              memcpy(uuid, message + pos, 16);
+              return true;
+            }
+            pos += value;
+            break;
+          default:
+            return false;
+        }
+      }
+      return false;
+    }
+
     void TeslaBLEVehicle::dump_config()
     {
       ESP_LOGCONFIG(TAG, "Tesla BLE Vehicle:");
       LOG_BINARY_SENSOR("  ", "Asleep Sensor", binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]);
+      ESP_LOGCONFIG(TAG, "  Prefer 2M PHY: %s", YESNO(prefer_2m_phy_));
+#ifndef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+      if (prefer_2m_phy_)
+      {
+        ESP_LOGCONFIG(TAG, "  2M PHY is not supported on this chip, staying on 1M PHY");
+      }
+#endif
+      ESP_LOGCONFIG(TAG, "  Data length extension: %s", YESNO(data_length_extension_));
+      ESP_LOGCONFIG(TAG, "  Reliable writes: %s", YESNO(reliable_writes_));
     }
     TeslaBLEVehicle::TeslaBLEVehicle() : tesla_ble_client_(new TeslaBLE::Client{})
     {
@@ -40,7 +107,6 @@ namespace esphome
       this->read_uuid_ = espbt::ESPBTUUID::from_raw(READ_UUID);
       this->write_uuid_ = espbt::ESPBTUUID::from_raw(WRITE_UUID);
       ble_disconnected_time_ = millis(); // Initialise disconnect time on startup
-      ble_read_buffer_.reserve(MAX_BLE_MESSAGE_SIZE);
 
       this->initializeFlash();
       this->openNVSHandle();
@@ -94,306 +160,303 @@ namespace esphome
     }
 
     void TeslaBLEVehicle::process_command_queue()
+    /*
+    *   Steps the command at the head of each lane until it has to wait for something, so states that are already satisfied
+    *   (a session that is still valid, a car that is already awake) are passed through in one go rather than one per loop.
+    *   A lock waits for nothing but VCSEC, however long an infotainment command takes to wake the car. While the breaker is
+    *   open, a lane only moves if the breaker allows the command at its head.
+    */
     {
-      if (command_queue_.empty())
+      expireCommands();
+      if (breaker_.update(millis()))
       {
-        return;
+        ESP_LOGI(TAG, "Trying commands again in case the key has been added since the car rejected it");
+        publishBreakerState();
+      }
+      for (UniversalMessage_Domain lane : COMMAND_LANES)
+      {
+        for (int step = 0; step < MAX_COMMAND_STEPS; step++)
+        {
+          int index = command_queue_.head(lane);
+          if ((index >= 0) and not breaker_.allows(command_queue_.at(index)))
+          {
+            break;
+          }
+          if (not advance_command(lane))
+          {
+            break;
+          }
+        }
       }
+    }
 
-      BLECommand current_command = command_queue_.front();
-      uint32_t now = millis();
-      // Overall timeout check
-      if ((now - current_command.started_at) > COMMAND_TIMEOUT)
+    bool TeslaBLEVehicle::advance_command(UniversalMessage_Domain lane)
+    /*
+    *   Moves the oldest command of the lane on by one state if it can. Returns true if it did, or if the command finished.
+    */
+    {
+      int index = command_queue_.head(lane);
+      if (index < 0)
       {
-        ESP_LOGW(TAG, "[%s] Command timed out after %d ms with %d commands in the queue", current_command.execute_name.c_str(), COMMAND_TIMEOUT, command_queue_.size());
-        command_queue_.pop();
-        return;
+        return false;
       }
+
+      BLECommand &current_command = command_queue_.at(index);
+      BLECommandState state_before = current_command.state;
+      uint32_t now = millis();
       switch (current_command.state)
       {
       case BLECommandState::IDLE:
-        ESP_LOGI(TAG, "[%s] Preparing command.. action value %d", current_command.execute_name.c_str(), current_command.action);
+        ESP_LOGI(TAG, "[%s] Preparing command.. action value %d", current_command.name(), current_command.action);
         /*
-         * If the car is asleep and the command is an Infotainment data request (identified by a "get" in the execute_name
-         * field), then ignore the request as we don't want to risk waking the car.
+         * If the car is asleep and the command is an Infotainment data request (a GetVehicleDataMessage in ACTION_SPECIFICS),
+         * then ignore the request as we don't want to risk waking the car.
         */
-        if (binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state && (current_command.execute_name.find("get") == 0))
+        if (binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state && current_command.is_get())
         {
-          ESP_LOGI(TAG, "[%s] Car is asleep, don't wake for a 'get' command", current_command.execute_name.c_str());
-          command_queue_.pop();
-          return;
+          ESP_LOGI(TAG, "[%s] Car is asleep, don't wake for a 'get' command", current_command.name());
+          finishCommand(index, BLECommandOutcome::FAILURE);
+          return true;
         }
         current_command.started_at = now;
         switch (current_command.domain)
         {
         case UniversalMessage_Domain_DOMAIN_BROADCAST:
-          ESP_LOGD(TAG, "[%s] No auth required, executing command..", current_command.execute_name.c_str());
+          ESP_LOGD(TAG, "[%s] No auth required, executing command..", current_command.name());
           current_command.state = BLECommandState::READY;
           break;
         case UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY:
-          ESP_LOGD(TAG, "[%s] VCSEC required, validating VCSEC session..", current_command.execute_name.c_str());
+          ESP_LOGD(TAG, "[%s] VCSEC required, validating VCSEC session..", current_command.name());
           current_command.state = BLECommandState::WAITING_FOR_VCSEC_AUTH;
           break;
         case UniversalMessage_Domain_DOMAIN_INFOTAINMENT:
-          ESP_LOGD(TAG, "[%s] INFOTAINMENT required, validating INFOTAINMENT session..", current_command.execute_name.c_str());
+          ESP_LOGD(TAG, "[%s] INFOTAINMENT required, validating INFOTAINMENT session..", current_command.name());
           current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
           break;
         }
         break;
       case BLECommandState::WAITING_FOR_VCSEC_AUTH:
-        if (now - current_command.last_tx_at > MAX_LATENCY)
-        {
-          auto session = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
-          if (session->isInitialized())
+      {
+        auto session = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+        if (session->isInitialized())
+        { // No need to wait, whether it was already valid or has just been updated
+          ESP_LOGD(TAG, "[%s] VCSEC session authenticated", current_command.name());
+          switch (current_command.domain)
           {
-            ESP_LOGD(TAG, "[%s] VCSEC session authenticated", current_command.execute_name.c_str());
-            switch (current_command.domain)
-            {
-            case UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY:
-              current_command.state = BLECommandState::READY;
-              break;
-            case UniversalMessage_Domain_DOMAIN_INFOTAINMENT:
-              ESP_LOGD(TAG, "[%s] Validating INFOTAINMENT session..", current_command.execute_name.c_str());
-              current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
-              break;
-            case UniversalMessage_Domain_DOMAIN_BROADCAST:
-              ESP_LOGE(TAG, "[%s] Invalid state: VCSEC authenticated but no auth required", current_command.execute_name.c_str());
-              // pop command
-              command_queue_.pop();
-              return;
-            }
+          case UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY:
+            current_command.state = BLECommandState::READY;
+            break;
+          case UniversalMessage_Domain_DOMAIN_INFOTAINMENT:
+            ESP_LOGD(TAG, "[%s] Validating INFOTAINMENT session..", current_command.name());
+            current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
+            current_command.retry_count = 0;
             break;
+          case UniversalMessage_Domain_DOMAIN_BROADCAST:
+            ESP_LOGE(TAG, "[%s] Invalid state: VCSEC authenticated but no auth required", current_command.name());
+            // pop command
+            finishCommand(index, BLECommandOutcome::FAILURE);
+            return true;
           }
-          else
+        }
+        else if ((current_command.retry_count == 0) or (now - current_command.last_tx_at > current_command.retry_delay))
+        { // Asked straight away the first time, after that only once the last request has had its chance
+          ESP_LOGW(TAG, "[%s] VCSEC auth expired, refreshing session..", current_command.name());
+          ESP_LOGD(TAG, "[%s] Waiting for VCSEC auth | attempt %d/%d", current_command.name(), current_command.retry_count + 1, MAX_RETRIES);
+          if (current_command.retry_count < MAX_RETRIES)
           {
-            ESP_LOGW(TAG, "[%s] VCSEC auth expired, refreshing session..", current_command.execute_name.c_str());
-            current_command.retry_count++;
-            ESP_LOGD(TAG, "[%s] Waiting for VCSEC auth | attempt %d/%d", current_command.execute_name.c_str(), current_command.retry_count, MAX_RETRIES);
-            if (current_command.retry_count <= MAX_RETRIES)
-            {
-              //sendSessionInfoRequest(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
-              sendSessionInfoRequest(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
-              current_command.last_tx_at = now;
-              current_command.state = BLECommandState::WAITING_FOR_VCSEC_AUTH_RESPONSE;
+            if (sendSessionInfoRequest(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY) != 0)
+            { // Nothing was queued, so no UUID to wait on. Tried again next loop without using up an attempt
+              ESP_LOGE(TAG, "[%s] Failed to send VCSEC session info request", current_command.name());
+              break;
             }
-            else
-            {
-              ESP_LOGE(TAG, "[%s] Failed to authenticate VCSEC after %d retries, giving up", current_command.execute_name.c_str(), MAX_RETRIES);
-              // pop command
-              command_queue_.pop();
-              return;
+            current_command.retry_count++;
+            if (current_command.retry_count > 1)
+            { // The last request went unanswered
+              backOffResponseTimeout(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
             }
+            noteRequestUUID(current_command);
+            current_command.last_tx_at = now;
+            current_command.retry_delay = retryDelay(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+            current_command.state = BLECommandState::WAITING_FOR_VCSEC_AUTH_RESPONSE;
+          }
+          else
+          {
+            ESP_LOGE(TAG, "[%s] Failed to authenticate VCSEC after %d retries, giving up", current_command.name(), MAX_RETRIES);
+            noteUnanswered(current_command.written);
+            // pop command
+            finishCommand(index, BLECommandOutcome::FAILURE);
+            return true;
           }
         }
         break;
+      }
 
-      case BLECommandState::WAITING_FOR_VCSEC_AUTH_RESPONSE:
-        if (now - current_command.last_tx_at > MAX_LATENCY)
+      case BLECommandState::WAITING_FOR_VCSEC_AUTH_RESPONSE: // Left early by handleSessionInfoUpdate when the session info arrives
+        if (now - current_command.last_tx_at > responseTimeout(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY))
         {
-          ESP_LOGW(TAG, "[%s] Timeout while waiting for VCSEC SessionInfo, retrying..", current_command.execute_name.c_str());
+          ESP_LOGW(TAG, "[%s] Timeout while waiting for VCSEC SessionInfo, retrying..", current_command.name());
           current_command.state = BLECommandState::WAITING_FOR_VCSEC_AUTH;
         }
         break;
 
       case BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH:
-        if (now - current_command.last_tx_at > MAX_LATENCY)
+        if (!binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state == false)
         {
-          if (!binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state == false)
+          ESP_LOGW(TAG, "[%s] Car is asleep, initiating wake..", current_command.name());
+          current_command.state = BLECommandState::WAITING_FOR_WAKE;
+        }
+        else
+        {
+          auto session = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+          if (session->isInitialized())
           {
-            ESP_LOGW(TAG, "[%s] Car is asleep, initiating wake..", current_command.execute_name.c_str());
-            current_command.state = BLECommandState::WAITING_FOR_WAKE;
+            ESP_LOGD(TAG, "[%s] INFOTAINMENT authenticated", current_command.name());
+            current_command.state = BLECommandState::READY;
           }
-          else
-          {
-            auto session = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
-            if (session->isInitialized())
+          else if ((current_command.retry_count == 0) or (now - current_command.last_tx_at > current_command.retry_delay))
+          { // Asked straight away the first time, after that only once the last request has had its chance
+            ESP_LOGW(TAG, "[%s] INFOTAINMENT auth expired, refreshing session..", current_command.name());
+            ESP_LOGD(TAG, "[%s] Waiting for INFOTAINMENT auth.. | attempt %d/%d", current_command.name(), current_command.retry_count + 1, MAX_RETRIES);
+            if (current_command.retry_count < MAX_RETRIES)
             {
-              ESP_LOGD(TAG, "[%s] INFOTAINMENT authenticated", current_command.execute_name.c_str());
-              current_command.state = BLECommandState::READY;
+              if (sendSessionInfoRequest(UniversalMessage_Domain_DOMAIN_INFOTAINMENT) != 0)
+              { // Nothing was queued, so no UUID to wait on. Tried again next loop without using up an attempt
+                ESP_LOGE(TAG, "[%s] Failed to send INFOTAINMENT session info request", current_command.name());
+                break;
+              }
+              //sendSessionInfoRequest(UniversalMessage_Domain_DOMAIN_INFOTAINMENT); // Original had line duplicated. Removed but left commented in case there was a reason for it
+              current_command.retry_count++;
+              if (current_command.retry_count > 1)
+              { // The last request went unanswered
+                backOffResponseTimeout(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+              }
+              noteRequestUUID(current_command);
+              current_command.last_tx_at = now;
+              current_command.retry_delay = retryDelay(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+              current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH_RESPONSE;
             }
             else
             {
-              ESP_LOGW(TAG, "[%s] INFOTAINMENT auth expired, refreshing session..", current_command.execute_name.c_str());
-              current_command.retry_count++;
-              ESP_LOGD(TAG, "[%s] Waiting for INFOTAINMENT auth.. | attempt %d/%d", current_command.execute_name.c_str(), current_command.retry_count, MAX_RETRIES);
-              if (current_command.retry_count <= MAX_RETRIES)
-              {
-                sendSessionInfoRequest(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
-                //sendSessionInfoRequest(UniversalMessage_Domain_DOMAIN_INFOTAINMENT); // Original had line duplicated. Removed but left commented in case there was a reason for it
-                current_command.last_tx_at = now;
-                current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH_RESPONSE;
-              }
-              else
-              {
-                ESP_LOGE(TAG, "[%s] Failed INFOTAINMENT auth after %d retries, giving up", current_command.execute_name.c_str(), MAX_RETRIES);
-                // pop command
-                command_queue_.pop();
-                return;
-              }
+              ESP_LOGE(TAG, "[%s] Failed INFOTAINMENT auth after %d retries, giving up", current_command.name(), MAX_RETRIES);
+              noteUnanswered(current_command.written);
+              // pop command
+              finishCommand(index, BLECommandOutcome::FAILURE);
+              return true;
             }
           }
         }
         break;
 
       case BLECommandState::WAITING_FOR_WAKE:
-        if ((now - current_command.last_tx_at) > MAX_LATENCY)
-        {
-          if (current_command.retry_count > MAX_RETRIES)
-          {
-            ESP_LOGE(TAG, "[%s] Failed to wake vehicle after %d retries", current_command.execute_name.c_str(), MAX_RETRIES);
-            // pop command
-            command_queue_.pop();
-            return;
-          }
-          else
-          {
-            ESP_LOGD(TAG, "[%s] Sending wake command | attempt %d/%d", current_command.execute_name.c_str(), current_command.retry_count, MAX_RETRIES);
-            int result = this->sendVCSECActionMessage(VCSEC_RKEAction_E_RKE_ACTION_WAKE_VEHICLE);
-            if (result != 0)
-            {
-              ESP_LOGE(TAG, "[%s] Failed to send wake command", current_command.execute_name.c_str());
-            }
-            current_command.last_tx_at = now;
-            current_command.retry_count++;
-            current_command.state = BLECommandState::WAITING_FOR_WAKE_RESPONSE;
-          }
-        }
+        // Joins the wake under way, or starts one straight away (see process_wake)
+        ESP_LOGD(TAG, "[%s] Waiting for the vehicle to wake", current_command.name());
+        requestWake(now);
+        current_command.state = BLECommandState::WAITING_FOR_WAKE_RESPONSE;
         break;
 
       case BLECommandState::WAITING_FOR_WAKE_RESPONSE:
-        if ((now - current_command.last_tx_at) > MAX_LATENCY)
-        {
-          if (binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state == false)
-          {
-            if (strcmp(current_command.execute_name.c_str(), "wake vehicle") == 0) {
-              ESP_LOGD(TAG, "[%s] Vehicle is awake, command completed", current_command.execute_name.c_str());
-              command_queue_.pop();
-              return;
-            }
-            else {
-              ESP_LOGD(TAG, "[%s] Vehicle is awake, waiting for infotainment auth", current_command.execute_name.c_str());
-              current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
-              current_command.retry_count = 0;
-            }
+        if (binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state == false)
+        { // Acted on as soon as a vehicle status says so, rather than after the next poll
+          if (current_command.detail().doneWhenAwake) {
+            ESP_LOGD(TAG, "[%s] Vehicle is awake, command completed", current_command.name());
+            finishCommand(index, BLECommandOutcome::SUCCESS);
+            return true;
           }
-          else
-          {
-            // send info status
-            ESP_LOGD(TAG, "[%s] Polling for wake response.. | attempt %d/%d", current_command.execute_name.c_str(), current_command.retry_count, MAX_RETRIES);
-            // alternate between sending wake command and info status
-            // vehicle can need multiple wake commands to wake up
-            if ((current_command.retry_count % 2) == 0)
-            {
-              int result = this->sendVCSECActionMessage(VCSEC_RKEAction_E_RKE_ACTION_WAKE_VEHICLE);
-              if (result != 0)
-              {
-                ESP_LOGE(TAG, "[%s] Failed to send wake command", current_command.execute_name.c_str());
-              }
-            }
-            else
-            {
-              int result = this->sendVCSECInformationRequest();
-              if (result != 0)
-              {
-                ESP_LOGE(TAG, "[%s] Failed to send VCSECInformationRequest", current_command.execute_name.c_str());
-              }
-            }
-            current_command.last_tx_at = now;
-            current_command.retry_count++;
-
-            if (current_command.retry_count > MAX_RETRIES)
-            {
-              ESP_LOGE(TAG, "[%s] Failed to wake up vehicle after %d retries", current_command.execute_name.c_str(), MAX_RETRIES);
-              // pop command
-              command_queue_.pop();
-              return;
-            }
+          else {
+            ESP_LOGD(TAG, "[%s] Vehicle is awake, waiting for infotainment auth", current_command.name());
+            current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
+            current_command.retry_count = 0;
           }
         }
+        else if (wakeStatus(now) == WakeStatus::FAILED)
+        {
+          ESP_LOGE(TAG, "[%s] Failed to wake up vehicle after %d retries", current_command.name(), MAX_RETRIES);
+          finishCommand(index, BLECommandOutcome::FAILURE);
+          return true;
+        }
+        else
+        { // Asleep again since the last wake, so wake it again
+          requestWake(now);
+        }
         break;
+
       case BLECommandState::WAITING_FOR_LOCK_RESPONSE:
+      {
         /*
         *   If the car lock state is as requested, the command has completed successfully. Otherwise if the car's been given enough time
         *   to respond to the last info request (which is sent after a short delay from sending the (un)lock command), try sending
-        *   the (un)lock command again.
+        *   the (un)lock command again. Both waits follow the VCSEC round trip, the first no longer than RX_TIMEOUT.
         */
-        if (((binary_sensors_[static_cast<size_t>(BinarySensorId::IsUnlocked)]->state == true) and (strcmp(current_command.execute_name.c_str(), "unlock vehicle") == 0)) or
-            ((binary_sensors_[static_cast<size_t>(BinarySensorId::IsUnlocked)]->state == false) and (strcmp(current_command.execute_name.c_str(), "lock vehicle") == 0)))
+        uint32_t lock_settle = std::min(responseTimeout(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY), static_cast<uint32_t>(RX_TIMEOUT));
+        if (binary_sensors_[static_cast<size_t>(BinarySensorId::IsUnlocked)]->state == current_command.detail().unlockedWhenDone)
         {
-          ESP_LOGI (TAG, "[%s] Vehicle is (un)locked as required so command completed", current_command.execute_name.c_str());
-          command_queue_.pop();
-          return;
+          ESP_LOGI (TAG, "[%s] Vehicle is (un)locked as required so command completed", current_command.name());
+          finishCommand(index, BLECommandOutcome::SUCCESS);
+          return true;
         }
-        else if ((current_command.done_times == 0) and ((now - current_command.last_tx_at) > RX_TIMEOUT)) 
+        else if ((current_command.done_times == 0) and ((now - current_command.last_tx_at) > lock_settle))
         { // Allow some time for the (un)lock command to do its thing before checking if it's worked
           int result = this->sendVCSECInformationRequest();
           if (result != 0)
           {
-            ESP_LOGE(TAG, "[%s] Failed to send VCSECInformationRequest", current_command.execute_name.c_str());
+            ESP_LOGE(TAG, "[%s] Failed to send VCSECInformationRequest", current_command.name());
           }
           current_command.done_times = 1; // Avoid repeatedly sending info requests
         }
-        else if ((now - current_command.last_tx_at) > MAX_LATENCY)
-        {
-          ESP_LOGW (TAG, "[%s] Timed out while waiting for successful (un)lock", current_command.execute_name.c_str());
+        else if ((now - current_command.last_tx_at) > lock_settle + responseTimeout(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY))
+        { // The info request has had as long to be answered as any other VCSEC request
+          ESP_LOGW (TAG, "[%s] Timed out while waiting for successful (un)lock", current_command.name());
           current_command.state = BLECommandState::READY;
         }
         break;
-      case BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH_RESPONSE:
-        if (now - current_command.last_tx_at > MAX_LATENCY)
+      }
+      case BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH_RESPONSE: // Left early by handleSessionInfoUpdate when the session info arrives
+        if (now - current_command.last_tx_at > responseTimeout(UniversalMessage_Domain_DOMAIN_INFOTAINMENT))
         {
-          ESP_LOGW(TAG, "[%s] Timeout while waiting for INFOTAINMENT SessionInfo, retrying..", current_command.execute_name.c_str());
+          ESP_LOGW(TAG, "[%s] Timeout while waiting for INFOTAINMENT SessionInfo, retrying..", current_command.name());
           current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
-          current_command.retry_count++;
         }
         break;
 
       case BLECommandState::READY:
-        // Ready to send a command
-        if (now - current_command.last_tx_at > MAX_LATENCY)
+        if (current_command.kind == BLECommandKind::WAKE)
+        { // Has no message of its own, it waits on the shared wake like any command needing the car awake
+          current_command.state = BLECommandState::WAITING_FOR_WAKE;
+          break;
+        }
+        // Ready to send a command, straight away unless it is being sent again, as long as the domain's request rate allows
+        if ((((current_command.sends == 0) and not current_command.send_failed) or (now - current_command.last_tx_at > current_command.retry_delay)) and
+            mayRequest(current_command.sends_to(), current_command, now))
         {
-          current_command.retry_count++;
-          if (current_command.retry_count > MAX_RETRIES)
+          if (current_command.retry_count >= current_command.policy().maxRetries)
           {
-            ESP_LOGE(TAG, "[%s] Failed to execute command after %d retries, giving up", current_command.execute_name.c_str(), MAX_RETRIES);
-            command_queue_.pop();
-            return;
+            ESP_LOGE(TAG, "[%s] Failed to execute command after %d retries, giving up", current_command.name(), current_command.policy().maxRetries);
+            noteUnanswered(current_command.written);
+            finishCommand(index, BLECommandOutcome::FAILURE);
+            return true;
           }
           else
           {
-            ESP_LOGI(TAG, "[%s] Executing command.. | attempt %d/%d", current_command.execute_name.c_str(), current_command.retry_count, MAX_RETRIES);
-            int result = current_command.execute();
+            ESP_LOGI(TAG, "[%s] Executing command.. | attempt %d/%d", current_command.name(), current_command.retry_count + 1, current_command.policy().maxRetries);
+            int result = executeCommand(current_command);
             if (result == 0)
-            {
-              ESP_LOGI(TAG, "[%s] Command executed, waiting for response..", current_command.execute_name.c_str());
-              current_command.last_tx_at = now;
-
-              if (strcmp(current_command.execute_name.c_str(), "wake vehicle") == 0)
-              {
-                current_command.state = BLECommandState::WAITING_FOR_WAKE_RESPONSE;
-              }
-              else if ((strcmp(current_command.execute_name.c_str(), "unlock vehicle") == 0) or
-                       (strcmp(current_command.execute_name.c_str(), "lock vehicle") == 0))
-              {
-                current_command.state = BLECommandState::WAITING_FOR_LOCK_RESPONSE;
-                current_command.done_times = 0;
-              }
-              else
-              {
-                current_command.state = BLECommandState::WAITING_FOR_RESPONSE;
-              }
+            { // Only an attempt that was queued to send counts against its retries and the request rate
+              ESP_LOGI(TAG, "[%s] Command executed, waiting for response..", current_command.name());
+              current_command.retry_count++;
+              commandSent(current_command, now);
             }
             else
             {
-              ESP_LOGE(TAG, "[%s] Command execution failed, retrying..", current_command.execute_name.c_str());
+              ESP_LOGE(TAG, "[%s] Command execution failed, retrying..", current_command.name());
+              commandSendFailed(current_command, now);
             }
           }
         }
         break;
       case BLECommandState::WAITING_FOR_RESPONSE:
-        if (now - current_command.last_tx_at > MAX_LATENCY)
+        if (now - current_command.last_tx_at > responseTimeout(current_command.sends_to()))
         {
-          ESP_LOGW(TAG, "[%s] Timed out while waiting for command response", current_command.execute_name.c_str());
+          ESP_LOGW(TAG, "[%s] Timed out while waiting for command response", current_command.name());
           current_command.state = BLECommandState::READY;
         }
         break;
@@ -401,1034 +464,2412 @@ namespace esphome
         /*
         *   Command was issued so want to see if its outcome. Allow a delay for the command to complete before requesting the data
         */
-        if ((now - current_command.last_tx_at) > RX_TIMEOUT)
+        if ((now - current_command.last_tx_at) > std::min(responseTimeout(UniversalMessage_Domain_DOMAIN_INFOTAINMENT), static_cast<uint32_t>(RX_TIMEOUT)))
         {
-          auto& detail = get_action_detail(current_command.action);
-          ESP_LOGI (TAG, "[%s] Action message waiting before sending get %d", current_command.execute_name.c_str(), static_cast<int>(detail.getOnSet));
-          switch (detail.getOnSet)
-          {
-            case GetOnSet::GetChargeState:
-              sendCarServerVehicleActionMessage (BLE_CarServer_VehicleAction::GET_CHARGE_STATE, 0);
-              break;
-            case GetOnSet::GetClimateState:
-              sendCarServerVehicleActionMessage (BLE_CarServer_VehicleAction::GET_CLIMATE_STATE, 0);
-              break;
-            case GetOnSet::GetDriveState:
-              sendCarServerVehicleActionMessage (BLE_CarServer_VehicleAction::GET_DRIVE_STATE, 0);
-              break;
-            case GetOnSet::GetClosureState:
-              sendCarServerVehicleActionMessage (BLE_CarServer_VehicleAction::GET_CLOSURES_STATE, 0);
-              break;
-            default:
-              break; // do nothing
-          }
-          command_queue_.pop(); // The command is complete
-          return;
+          ESP_LOGI (TAG, "[%s] Action message waiting before sending get %d", current_command.name(), static_cast<int>(get_action_detail(current_command.action).getOnSet));
+          requestGetOnSet(current_command.action);
+          finishCommand(index, BLECommandOutcome::SUCCESS); // The command is complete
+          return true;
         }
         break;
       }
-      command_queue_.front() = current_command; // Update the current (front) command
+      return current_command.state != state_before;
     }
 
-    void TeslaBLEVehicle::process_ble_write_queue()
-    {
-      if (this->ble_write_queue_.empty())
+    void TeslaBLEVehicle::requestWake(uint32_t now)
+    { // Starts a wake unless one is under way or has just failed, commands then follow its progress through wakeStatus
+      WakeStatus status = wakeStatus(now);
+      if ((status == WakeStatus::WAKING) or (status == WakeStatus::FAILED))
       {
         return;
       }
-      BLETXChunk chunk_ = this->ble_write_queue_.front();
-      int gattc_if = this->parent()->get_gattc_if();
-      uint16_t conn_id = this->parent()->get_conn_id();
-      esp_err_t err = esp_ble_gattc_write_char(gattc_if, conn_id, this->write_handle_, chunk_.data.size(), chunk_.data.data(), chunk_.write_type, chunk_.auth_req);
-      if (err)
-      {
-        ESP_LOGW(TAG, "Error sending write value to BLE gattc server, error=%d", err);
-      }
-      else
-      {
-        ESP_LOGV(TAG, "BLE TX: %s", format_hex(chunk_.data.data(), chunk_.data.size()).c_str());
-        this->ble_write_queue_.pop();
-      }
+      ESP_LOGI(TAG, "Waking vehicle for queued commands");
+      wake_.status = WakeStatus::WAKING;
+      wake_.attempts = 0;
     }
 
-    void TeslaBLEVehicle::process_ble_read_queue()
+    WakeStatus TeslaBLEVehicle::wakeStatus(uint32_t now) const
     {
-      if (this->ble_read_queue_.empty())
-      {
-        return;
-      }
-
-      BLERXChunk chunk_ = this->ble_read_queue_.front();
-      ESP_LOGV(TAG, "BLE RX chunk: %s", format_hex(chunk_.buffer.data(), chunk_.buffer.size()).c_str());
-
-      // check we are not overflowing the buffer before appending data
-      size_t buffer_len_post_append = chunk_.buffer.size() + this->ble_read_buffer_.size();
-      if (buffer_len_post_append > MAX_BLE_MESSAGE_SIZE)
-      {
-        ESP_LOGE(TAG, "BLE RX: Message length (%d) exceeds max BLE message size", buffer_len_post_append);
-        // clear buffer
-        this->ble_read_buffer_.clear();
-//        this->ble_read_buffer_.shrink_to_fit();
-        return;
-      }
-
-      // Append the new data
-      ESP_LOGV(TAG, "BLE RX: Appending new data to read buffer");
-      this->ble_read_buffer_.insert(this->ble_read_buffer_.end(), chunk_.buffer.begin(), chunk_.buffer.end());
-      this->ble_read_queue_.pop();
-
-      if (this->ble_read_buffer_.size() >= 2)
-      {
-        int message_length = (this->ble_read_buffer_.front() << 8) | this->ble_read_buffer_.at(1);
-
-        if (this->ble_read_buffer_.size() >= 2 + message_length)
-        {
-          ESP_LOGD(TAG, "BLE RX: %s", format_hex(this->ble_read_buffer_.data(), this->ble_read_buffer_.size()).c_str());
-        }
-        else
-        {
-          ESP_LOGD(TAG, "BLE RX: Buffered chunk, waiting for more data.. (%d/%d): %s", this->ble_read_buffer_.size(), 2 + message_length, format_hex(this->ble_read_buffer_.data(), this->ble_read_buffer_.size()).c_str());
-          return;
-        }
-      }
-      else
-      {
-        ESP_LOGW(TAG, "BLE RX: Not enough data to determine message length");
-        return;
-      }
-      read_queue_message_ = UniversalMessage_RoutableMessage_init_default;
-      int return_code = tesla_ble_client_->parseUniversalMessageBLE (this->ble_read_buffer_.data(), this->ble_read_buffer_.size(), &read_queue_message_);
-      if (return_code != 0)
+      if ((wake_.status != WakeStatus::WAKING) and ((now - wake_.finished_at) > WAKE_RESULT_VALIDITY))
       {
-        this->ble_read_buffer_.clear();         // This will set the size to 0 
-        ESP_LOGW(TAG, "BLE RX: Failed to parse incoming message");
+        return WakeStatus::IDLE;
       }
-      ESP_LOGD(TAG, "BLE RX: Parsed UniversalMessage");
-      // clear read buffer
-      this->ble_read_buffer_.clear();         // This will set the size to 0
-//      this->ble_read_buffer_.shrink_to_fit(); // This will reduce the capacity to fit the size
-
-      response_queue_.emplace(read_queue_message_);
-      return;
+      return wake_.status;
     }
 
-    void TeslaBLEVehicle::process_response_queue()
+    void TeslaBLEVehicle::process_wake()
+    /*
+    *   Sends the wake shared by every command waiting for the car to wake. The car can need more than one wake, so once it has
+    *   had MAX_LATENCY to answer, wakes alternate with status requests until a vehicle status shows it awake or MAX_RETRIES
+    *   have been sent. It waits while the breaker is open, as a car that answers nothing won't answer a wake. Without a valid
+    *   VCSEC session a wake can't be signed, so the attempt asks for a new session instead and the wakes carry on once it is up.
+    */
     {
-      if (response_queue_.empty())
+      if ((wake_.status != WakeStatus::WAKING) or breaker_.open())
       {
         return;
       }
-
-      read_queue_message_ = response_queue_.front().message; //response.message;
-      response_queue_.pop();
-
-      //log_routable_message (TAG, &message);
-
-      if (not read_queue_message_.has_from_destination)
+      uint32_t now = millis();
+      if (binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state == false)
       {
-        ESP_LOGD(TAG, "[x] Dropping message with missing source");
+        ESP_LOGI(TAG, "Vehicle is awake after %d attempts", wake_.attempts);
+        wake_.status = WakeStatus::AWAKE;
+        wake_.finished_at = now;
         return;
       }
-
-      if ((read_queue_message_.request_uuid.size != 0) && (read_queue_message_.request_uuid.size != 16))
-      {
-        ESP_LOGW(TAG, "[x] Dropping message with invalid request UUID length");
+      bool session_valid = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY)->isInitialized();
+      if ((wake_.attempts != 0) and ((now - wake_.last_tx_at) <= MAX_LATENCY) and not (wake_.refreshing_session and session_valid))
+      { // A refreshed session needn't wait out the rest of MAX_LATENCY
         return;
       }
-      std::string request_uuid_hex_string = format_hex(read_queue_message_.request_uuid.bytes, read_queue_message_.request_uuid.size);
-      const char *request_uuid_hex = request_uuid_hex_string.c_str();
-
-      if (not read_queue_message_.has_to_destination)
+      if (wake_.attempts >= MAX_RETRIES)
       {
-        ESP_LOGW(TAG, "[%s] Dropping message with missing destination", request_uuid_hex);
+        ESP_LOGE(TAG, "Failed to wake vehicle after %d attempts", wake_.attempts);
+        wake_.status = WakeStatus::FAILED;
+        wake_.finished_at = now;
+        noteUnanswered(wake_.written); // Once for the wake, however many commands were waiting on it
         return;
       }
-
-      switch (read_queue_message_.to_destination.which_sub_destination)
-      {
-      case UniversalMessage_Destination_domain_tag:
+      if (not bucket(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY).available(now))
       {
-        ESP_LOGD(TAG, "[%s] Dropping message to %s", request_uuid_hex, domain_to_string(read_queue_message_.from_destination.sub_destination.domain));
         return;
       }
-      case UniversalMessage_Destination_routing_address_tag:
+      int result;
+      ble_tx_full_ = false;
+      if (not session_valid)
       {
-        // Continue
-        ESP_LOGD(TAG, "Continuing message with routing address");
-        break;
+        ESP_LOGW(TAG, "VCSEC session invalid, refreshing it before waking.. | attempt %d/%d", wake_.attempts + 1, MAX_RETRIES);
+        result = this->sendSessionInfoRequest(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
       }
-      default:
+      else
       {
-        ESP_LOGW(TAG, "[%s] Dropping message with unrecognized destination type, %d", request_uuid_hex, read_queue_message_.to_destination.which_sub_destination);
-        return;
+        ESP_LOGD(TAG, "Waking vehicle.. | attempt %d/%d", wake_.attempts + 1, MAX_RETRIES);
+        result = ((wake_.attempts % 2) == 0) ? this->sendVCSECActionMessage(VCSEC_RKEAction_E_RKE_ACTION_WAKE_VEHICLE) :
+                                                this->sendVCSECInformationRequest();
       }
-      }
-
-      if (read_queue_message_.to_destination.sub_destination.routing_address.size != 16)
+      wake_.refreshing_session = not session_valid;
+      if (result != 0)
       {
-        ESP_LOGW(TAG, "[%s] Dropping message with invalid address length", request_uuid_hex);
+        if (ble_tx_full_)
+        { // Nothing went, but the TX ring soon drains so tried again next loop without using up an attempt
+          return;
+        }
+        // Most likely to fail again straight away, so it uses up an attempt and waits like one that went unanswered
+        ESP_LOGE(TAG, "Failed to send wake attempt %d", wake_.attempts + 1);
+        wake_.has_request_uuid = false;
+        wake_.written = false;
+        wake_.last_tx_at = now;
+        wake_.attempts++;
         return;
       }
-      if (read_queue_message_.has_signedMessageStatus)
+      bucket(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY).take();
+      wake_.has_request_uuid = ble_tx_has_uuid_;
+      memcpy(wake_.request_uuid, ble_tx_uuid_, sizeof(wake_.request_uuid));
+      wake_.written = false;
+      wake_.last_tx_at = now;
+      wake_.attempts++;
+    }
+
+    void TeslaBLEVehicle::process_pipelined_commands()
+    /*
+    *   CarServer commands behind the head of the infotainment lane are sent without waiting for those ahead of them once the
+    *   infotainment session is up, with at most max_in_flight_ awaiting a response at once. Each one is then retried and timed
+    *   out on its own and handleResponse finds it again by the request UUID in the response.
+    */
+    {
+      int head = command_queue_.head(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+      if ((max_in_flight_ <= 1) or (head < 0) or breaker_.open())
       {
-        if (read_queue_message_.signedMessageStatus.operation_status == UniversalMessage_OperationStatus_E_OPERATIONSTATUS_ERROR)
-        {
-          // reset authentication for domain
-//          auto session = tesla_ble_client_->getPeer(read_queue_message_.from_destination.sub_destination.domain);
-          invalidateSession(read_queue_message_.from_destination.sub_destination.domain);
-        }
+        return;
       }
-
-      if (read_queue_message_.which_payload == UniversalMessage_RoutableMessage_session_info_tag)
+      uint32_t now = millis();
+      bool session_ready = (binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state == false) and
+                           tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_INFOTAINMENT)->isInitialized();
+      int in_flight = 0;
+      for (size_t i = 0; i < command_queue_.size(); i++)
       {
-        int return_code = this->handleSessionInfoUpdate(read_queue_message_, read_queue_message_.from_destination.sub_destination.domain);
-        if (return_code != 0)
+        const BLECommand &command = command_queue_.at(i);
+        if ((command.domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) and (command.state == BLECommandState::WAITING_FOR_RESPONSE))
         {
-          ESP_LOGE(TAG, "Failed to handle session info update");
-          return;
+          in_flight++;
         }
-        ESP_LOGI(TAG, "[%s] Updated session info for %s", request_uuid_hex, domain_to_string(read_queue_message_.from_destination.sub_destination.domain));
       }
 
-      if (read_queue_message_.has_signedMessageStatus)
+      for (size_t i = head + 1; i < command_queue_.size();)
       {
-        ESP_LOGD(TAG, "Received signed message status from domain %s", domain_to_string(read_queue_message_.from_destination.sub_destination.domain));
-        log_message_status(TAG, &read_queue_message_.signedMessageStatus);
-        if (read_queue_message_.signedMessageStatus.operation_status == UniversalMessage_OperationStatus_E_OPERATIONSTATUS_ERROR)
+        BLECommand &command = command_queue_.at(i);
+        if (command.kind != BLECommandKind::CARSERVER_ACTION)
         {
-          ESP_LOGE(TAG, "Received error message from domain %s", domain_to_string(read_queue_message_.from_destination.sub_destination.domain));
-          return;
+          i++;
+          continue;
         }
-        else if (read_queue_message_.signedMessageStatus.operation_status == UniversalMessage_OperationStatus_E_OPERATIONSTATUS_WAIT)
+        switch (command.state)
         {
-          ESP_LOGI(TAG, "Received wait message from domain %s", domain_to_string(read_queue_message_.from_destination.sub_destination.domain));
-          return;
-        }
-        else
+        case BLECommandState::IDLE:
+          if ((not session_ready) or (in_flight >= max_in_flight_))
+          {
+            break;
+          }
+          command.started_at = now;
+          command.state = BLECommandState::READY;
+          // fall through
+        case BLECommandState::READY:
+          if ((((command.sends == 0) and not command.send_failed) or ((now - command.last_tx_at) > command.retry_delay)) and
+              mayRequest(command.sends_to(), command, now))
+          {
+            if (command.retry_count >= command.policy().maxRetries)
+            {
+              ESP_LOGE(TAG, "[%s] Failed to execute pipelined command after %d retries, giving up", command.name(), command.policy().maxRetries);
+              noteUnanswered(command.written);
+              finishCommand(i, BLECommandOutcome::FAILURE);
+              continue;
+            }
+            ESP_LOGI(TAG, "[%s] Executing pipelined command.. | attempt %d/%d, %d in flight", command.name(), command.retry_count + 1, command.policy().maxRetries, in_flight);
+            if (executeCommand(command) == 0)
+            {
+              command.retry_count++;
+              commandSent(command, now);
+              in_flight++;
+            }
+            else
+            {
+              ESP_LOGE(TAG, "[%s] Pipelined command execution failed, retrying..", command.name());
+              commandSendFailed(command, now);
+            }
+          }
+          break;
+        case BLECommandState::WAITING_FOR_RESPONSE:
+          if ((now - command.last_tx_at) > responseTimeout(command.sends_to()))
+          {
+            ESP_LOGW(TAG, "[%s] Timed out while waiting for pipelined command response", command.name());
+            command.state = BLECommandState::READY;
+            in_flight--;
+          }
+          break;
+        case BLECommandState::WAITING_FOR_GET_POST_SET:
+          if ((now - command.last_tx_at) > std::min(responseTimeout(UniversalMessage_Domain_DOMAIN_INFOTAINMENT), static_cast<uint32_t>(RX_TIMEOUT)))
+          {
+            requestGetOnSet(command.action);
+            finishCommand(i, BLECommandOutcome::SUCCESS); // The command is complete
+            continue;
+          }
+          break;
+        default:
+          break;
+        }
+        i++;
+      }
+    }
+
+    void TeslaBLEVehicle::process_ble_write_queue()
+    /*
+    *   Hands as many chunks to the BLE stack as it can currently accept. Sending pauses while the link is congested (see
+    *   ESP_GATTC_CONGEST_EVT) and a failed write is retried after an increasing delay rather than on every loop.
+    *   With reliable_writes only one chunk is outstanding at a time and the next is sent once ESP_GATTC_WRITE_CHAR_EVT
+    *   confirms it.
+    */
+    {
+      if (this->ble_tx_ring_.empty())
+      {
+        return;
+      }
+      if (this->ble_tx_awaiting_ != 0)
+      {
+        if ((millis() - this->ble_tx_ring_.sent_at()) < TX_CONFIRM_TIMEOUT)
         {
-          ESP_LOGI(TAG, "Received success message from domain %s", domain_to_string(read_queue_message_.from_destination.sub_destination.domain));
+          return;
         }
+        ESP_LOGW(TAG, "BLE TX: Chunk not confirmed after %d ms", TX_CONFIRM_TIMEOUT);
+        this->retransmitBLE();
         return;
       }
-
-      if (read_queue_message_.which_payload == UniversalMessage_RoutableMessage_session_info_tag)
+      if (this->ble_tx_congested_)
       {
-        // log error and return if session info is present
         return;
       }
-
-      log_routable_message(TAG, &read_queue_message_);
-      switch (read_queue_message_.from_destination.which_sub_destination)
+      if ((this->ble_tx_backoff_ != 0) and ((millis() - this->ble_tx_failed_at_) < this->ble_tx_backoff_))
       {
-      case UniversalMessage_Destination_domain_tag:
+        return;
+      }
+      int gattc_if = this->parent()->get_gattc_if();
+      uint16_t conn_id = this->parent()->get_conn_id();
+      int sendable = std::min(static_cast<int>(esp_ble_get_cur_sendable_packets_num(conn_id)), MAX_TX_CHUNKS_PER_LOOP);
+      for (int i = 0; (i < sendable) and !this->ble_tx_ring_.empty() and !this->ble_tx_congested_; i++)
       {
-        ESP_LOGD(TAG, "Received message from domain %s", domain_to_string(read_queue_message_.from_destination.sub_destination.domain));
-        switch (read_queue_message_.from_destination.sub_destination.domain)
+        BLETXChunk chunk_ = this->ble_tx_ring_.next_chunk(this->ble_chunk_size_);
+        esp_gatt_write_type_t write_type = this->reliable_writes_ ? ESP_GATT_WRITE_TYPE_RSP : chunk_.write_type;
+        esp_err_t err = esp_ble_gattc_write_char(gattc_if, conn_id, this->write_handle_, chunk_.length, chunk_.data, write_type, chunk_.auth_req);
+        if (err)
         {
-        case UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY:
+          this->ble_tx_backoff_ = (this->ble_tx_backoff_ == 0) ? TX_BACKOFF_MIN : std::min(2 * this->ble_tx_backoff_, static_cast<uint32_t>(TX_BACKOFF_MAX));
+          this->ble_tx_failed_at_ = millis();
+          ESP_LOGW(TAG, "Error sending write value to BLE gattc server, error=%d, retrying in %d ms", err, static_cast<int>(this->ble_tx_backoff_));
+          return;
+        }
+        ESP_LOGV(TAG, "BLE TX: %s", format_hex(chunk_.data, chunk_.length).c_str());
+        this->ble_tx_backoff_ = 0;
+        this->ble_tx_ring_.mark_sent(millis());
+        if (this->reliable_writes_)
+        { // Wait for the car to confirm before moving on
+          this->ble_tx_awaiting_ = chunk_.length;
+          return;
+        }
+        if (this->ble_tx_ring_.consume(chunk_.length))
+        { // Its space is only reused by the next reserve, so the message can still be read
+          this->messageSent(chunk_.message, chunk_.message_length);
+        }
+      }
+    }
+
+    void TeslaBLEVehicle::retransmitBLE()
+    /*
+    *   A chunk of the message being sent wasn't confirmed, so send the whole message again rather than leaving the command
+    *   to time out and be re-signed. Waiting RX_TIMEOUT first lets the car discard the part of the message it already has.
+    */
+    {
+      this->ble_tx_awaiting_ = 0;
+      this->ble_tx_backoff_ = RX_TIMEOUT;
+      this->ble_tx_failed_at_ = millis();
+      if (this->ble_tx_ring_.rewind() > MAX_TX_RETRANSMITS)
+      {
+        ESP_LOGE(TAG, "BLE TX: Giving up on message after %d retransmits", MAX_TX_RETRANSMITS);
+        this->ble_tx_ring_.drop();
+        this->ble_tx_abandoned_++;
+        publishSensor (NumericSensorId::BleWritesAbandoned, this->ble_tx_abandoned_);
+        return;
+      }
+      ESP_LOGW(TAG, "BLE TX: Retransmitting message");
+      this->ble_tx_retransmits_++;
+      publishSensor (NumericSensorId::BleRetransmits, this->ble_tx_retransmits_);
+    }
+
+    unsigned char *BLETXRing::reserve(size_t length)
+    /*
+    *   Returns contiguous space for a message of up to length bytes, or nullptr if the ring is full. Nothing is claimed until
+    *   the message is committed, so an abandoned reservation costs nothing.
+    */
+    {
+      if ((length > TX_RING_SIZE) or (count_ == messages_.size()))
+      {
+        return nullptr;
+      }
+      if (count_ == 0)
+      { // Empty, so start again from the beginning
+        data_head_ = 0;
+        data_tail_ = 0;
+        return buffer_;
+      }
+      if (data_tail_ > data_head_)
+      { // Not wrapped: use the space at the end, else wrap to the space in front of the oldest message
+        if (TX_RING_SIZE - data_tail_ >= length)
         {
-          VCSEC_FromVCSECMessage vcsec_message = VCSEC_FromVCSECMessage_init_default;
-          int return_code = tesla_ble_client_->parseFromVCSECMessage(&read_queue_message_.payload.protobuf_message_as_bytes, &vcsec_message);
-          if (return_code != 0)
+          return buffer_ + data_tail_;
+        }
+        return (data_head_ >= length) ? buffer_ : nullptr;
+      }
+      // Wrapped: only the gap between the newest and oldest message is free
+      return (data_head_ - data_tail_ >= length) ? buffer_ + data_tail_ : nullptr;
+    }
+
+    bool BLETXRing::commit(const unsigned char *data, size_t length, esp_gatt_write_type_t write_type, esp_gatt_auth_req_t auth_req,
+                           BLETXPriority priority)
+    {
+      if ((count_ == messages_.size()) or !contains(data) or (length == 0))
+      {
+        return false;
+      }
+      size_t offset = data - buffer_;
+      if (offset + length > TX_RING_SIZE)
+      {
+        return false;
+      }
+      BLETXMessage &message = messages_[(head_ + count_) % messages_.size()];
+      message = BLETXMessage{};
+      message.offset = offset;
+      message.length = length;
+      message.write_type = write_type;
+      message.auth_req = auth_req;
+      message.priority = priority;
+      if (count_ == 0)
+      {
+        data_head_ = offset;
+      }
+      data_tail_ = offset + length;
+      count_++;
+      pending_++;
+      return true;
+    }
+
+    size_t BLETXRing::select_next()
+    /*
+    *   Picks the message to send from. A message that has started is always finished first so the chunks of two messages
+    *   never interleave on the characteristic. Otherwise the oldest CONTROL message goes ahead of the oldest NORMAL one.
+    */
+    {
+      if (active_ != NO_MESSAGE)
+      {
+        return active_;
+      }
+      for (BLETXPriority lane : {BLETXPriority::CONTROL, BLETXPriority::NORMAL})
+      {
+        for (size_t i = 0; i < count_; i++)
+        {
+          size_t index = (head_ + i) % messages_.size();
+          if (!messages_[index].done and (messages_[index].priority == lane))
           {
-            ESP_LOGE(TAG, "Failed to parse incoming message");
-            return;
+            active_ = index;
+            return active_;
           }
-          ESP_LOGD(TAG, "Parsed VCSEC message, which_sub_message = %i", vcsec_message.which_sub_message);
+        }
+      }
+      return NO_MESSAGE;
+    }
 
-          switch (vcsec_message.which_sub_message)
-          {
-          case VCSEC_FromVCSECMessage_vehicleStatus_tag:
-          {
-            ESP_LOGD(TAG, "Received vehicle status");
-            handleVCSECVehicleStatus(vcsec_message.sub_message.vehicleStatus);
+    BLETXChunk BLETXRing::next_chunk(size_t chunk_size)
+    {
+      BLETXMessage &message = messages_[select_next()];
+      return BLETXChunk{buffer_ + message.offset + message.sent, std::min(chunk_size, message.length - message.sent), message.write_type, message.auth_req,
+                        buffer_ + message.offset, message.length};
+    }
 
-            if (!command_queue_.empty())
-            {
-              BLECommand current_command = command_queue_.front();
-              switch (current_command.domain)
-              {
-              case UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY:
-                if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
-                {
-                  ESP_LOGI(TAG, "[%s] Received vehicle status, command completed", current_command.execute_name.c_str());
-                  command_queue_.pop();
-                  return;
-                }
-                break;
-              case UniversalMessage_Domain_DOMAIN_INFOTAINMENT:
-                switch (current_command.state)
-                {
-                case BLECommandState::WAITING_FOR_WAKE:
-                case BLECommandState::WAITING_FOR_WAKE_RESPONSE:
-                  switch (vcsec_message.sub_message.vehicleStatus.vehicleSleepStatus)
-                  {
-                  case VCSEC_VehicleSleepStatus_E_VEHICLE_SLEEP_STATUS_AWAKE:
-                    if (strcmp(current_command.execute_name.c_str(), "wake vehicle") == 0)
-                    {
-                      ESP_LOGI(TAG, "[%s] Received vehicle status, command completed", current_command.execute_name.c_str());
-                      command_queue_.pop();
-                      return;
-                    }
-                    else
-                    {
-                      ESP_LOGI(TAG, "[%s] Received vehicle status, vehicle is awake", current_command.execute_name.c_str());
-                      current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
-                      current_command.retry_count = 0;
-                    }
-                    break;
-                  default:
-                    ESP_LOGD(TAG, "[%s] Received vehicle status, vehicle is not awake", current_command.execute_name.c_str());
-                    break;
-                  }
-                  break;
+    bool BLETXRing::consume(size_t length)
+    { // Advance through the message being sent, marking it done once fully sent. Returns true if it now is
+      BLETXMessage &message = messages_[select_next()];
+      message.sent += length;
+      if (message.sent < message.length)
+      {
+        return false;
+      }
+      message.done = true;
+      active_ = NO_MESSAGE;
+      pending_--;
+      release_done();
+      return true;
+    }
 
-                case BLECommandState::WAITING_FOR_RESPONSE:
-                  if ((strcmp(current_command.execute_name.c_str(), "wake vehicle") == 0) ||
-                      (strcmp(current_command.execute_name.c_str(), "data update") == 0))
-                  {
-                    ESP_LOGI(TAG, "[%s] Received vehicle status, command completed", current_command.execute_name.c_str());
-                    command_queue_.pop();
-                    return;
-                  }
-                  else if (strcmp(current_command.execute_name.c_str(), "data update | forced") == 0)
-                  {
-                    switch (vcsec_message.sub_message.vehicleStatus.vehicleSleepStatus)
-                    {
-                    case VCSEC_VehicleSleepStatus_E_VEHICLE_SLEEP_STATUS_AWAKE:
-                      ESP_LOGI(TAG, "[%s] Received vehicle status, command completed", current_command.execute_name.c_str());
-                      command_queue_.pop();
-                      return;
-                    default:
-                      ESP_LOGD(TAG, "[%s] Received vehicle status, infotainment is not awake", current_command.execute_name.c_str());
-                      invalidateSession(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
-                      current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
-                    }
-                  }
-                  break;
-                default:
-                  break;
-                }
-              default:
-                break;
-              }
-              command_queue_.front() = current_command;
-            }
-            break;
-          }
-          case VCSEC_FromVCSECMessage_commandStatus_tag:
-          {
-            ESP_LOGD(TAG, "Received VCSEC command status");
-            log_vcsec_command_status(TAG, &vcsec_message.sub_message.commandStatus);
-            if (!command_queue_.empty())
+    void BLETXRing::release_done()
+    { // Space is handed back in the order it was taken, so stop at the oldest message not yet sent
+      while ((count_ > 0) and messages_[head_].done)
+      {
+        head_ = (head_ + 1) % messages_.size();
+        count_--;
+      }
+      data_head_ = (count_ == 0) ? data_tail_ : messages_[head_].offset;
+    }
+
+    uint8_t BLETXRing::rewind()
+    { // Start the message being sent again from the beginning, returns the number of times that has happened
+      BLETXMessage &message = messages_[select_next()];
+      message.sent = 0;
+      return ++message.retry_count;
+    }
+
+    void BLETXRing::drop()
+    { // Give up on the message being sent
+      BLETXMessage &message = messages_[select_next()];
+      consume(message.length - message.sent);
+    }
+
+    void BLETXRing::mark_sent(uint32_t now)
+    {
+      messages_[select_next()].sent_at = now;
+    }
+
+    uint32_t BLETXRing::sent_at()
+    {
+      return messages_[select_next()].sent_at;
+    }
+
+    void BLETXRing::clear()
+    {
+      head_ = 0;
+      count_ = 0;
+      pending_ = 0;
+      active_ = NO_MESSAGE;
+      data_head_ = 0;
+      data_tail_ = 0;
+    }
+
+    void TeslaBLEVehicle::setChunkSizeFromMTU(uint16_t mtu)
+    /*
+    *   Each write carries MTU - 3 bytes of the message. If the car didn't agree to more than the default MTU, keep to the
+    *   20 byte chunks used by vehicle_command.
+    */
+    {
+      if (mtu > BLOCK_LENGTH + ATT_HEADER_LENGTH)
+      {
+        ble_chunk_size_ = std::min(mtu - ATT_HEADER_LENGTH, MAX_BLOCK_LENGTH);
+      }
+      else
+      {
+        ble_chunk_size_ = BLOCK_LENGTH;
+      }
+      ESP_LOGI(TAG, "BLE MTU is %d, writing in chunks of %d bytes", mtu, ble_chunk_size_);
+      publishSensor (NumericSensorId::BleMtu, ble_chunk_size_ + ATT_HEADER_LENGTH);
+    }
+
+    void TeslaBLEVehicle::requestLinkUpgrade()
+    /*
+    *   Optionally asks the controller for the 2M PHY and for LE Data Length Extension so large responses take less radio
+    *   time. The outcome is reported in gap_event_handler.
+    */
+    {
+      if (data_length_extension_)
+      {
+        esp_err_t err = esp_ble_gap_set_pkt_data_len(this->parent()->get_remote_bda(), MAX_LL_DATA_LENGTH);
+        if (err != ESP_OK)
+        {
+          ESP_LOGW(TAG, "Data length extension request failed, error=%d", err);
+        }
+        this->data_length_requested_ = (err == ESP_OK);
+      }
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+      if (prefer_2m_phy_)
+      {
+        esp_err_t err = esp_ble_gap_set_preferred_phy(this->parent()->get_remote_bda(), 0, ESP_BLE_GAP_PHY_2M_PREF_MASK,
+                                                      ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+        if (err != ESP_OK)
+        {
+          ESP_LOGW(TAG, "2M PHY request failed, error=%d", err);
+        }
+      }
+#endif
+    }
+
+    void TeslaBLEVehicle::pushGattEvent(BLEGattEventType type, uint16_t value)
+    {
+      if (!this->gatt_events_.push(BLEGattEvent{type, value}))
+      {
+        ESP_LOGE(TAG, "GATT event queue full, event %d lost", static_cast<int>(type));
+      }
+    }
+
+    void TeslaBLEVehicle::process_gatt_events()
+    /*
+    *   Applies the GATT and GAP events that change TX state or sensors. They are queued by gattc_event_handler and
+    *   gap_event_handler so that state, and the sensors, are only ever touched from the loop, whichever task the BLE stack
+    *   calls back on. A disconnect is flagged rather than queued so it can't be lost, and is applied first so events from a
+    *   new connection land on a clean state.
+    */
+    {
+      if (this->ble_disconnect_pending_.exchange(false))
+      {
+        this->ble_tx_ring_.clear(); // A part sent message can't be resumed on a new connection
+        this->ble_tx_backoff_ = 0;
+        this->ble_tx_awaiting_ = 0;
+        this->ble_chunk_size_ = BLOCK_LENGTH;
+        this->vcsec_rtt_.reset(); // Measured again on the next connection
+        this->infotainment_rtt_.reset();
+        this->wake_ = BLEWakeOperation(); // Whatever it was doing ends with the connection
+        this->ble_rx_ring_.discard_stale(); // Responses from the old connection mean nothing to the new one
+        this->response_queue_.clear();
+      }
+      BLEGattEvent event;
+      while (this->gatt_events_.front(event))
+      {
+        this->gatt_events_.pop();
+        switch (event.type)
+        {
+        case BLEGattEventType::MTU:
+          setChunkSizeFromMTU(event.value);
+          break;
+        case BLEGattEventType::WRITE_CONFIRMED:
+          if (this->ble_tx_awaiting_ != 0)
+          { // Confirmed with reliable_writes, the next chunk can go
+            BLETXChunk chunk = this->ble_tx_ring_.next_chunk(this->ble_tx_awaiting_);
+            if (this->ble_tx_ring_.consume(this->ble_tx_awaiting_))
             {
-              BLECommand current_command = command_queue_.front();
-              if (current_command.domain == UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY)
-              {
-                switch (vcsec_message.sub_message.commandStatus.operationStatus)
-                {
-                case VCSEC_OperationStatus_E_OPERATIONSTATUS_OK:
-                  if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
-                  {
-                    ESP_LOGI(TAG, "[%s] Received VCSEC OK message, command completed", current_command.execute_name.c_str());
-                    command_queue_.pop();
-                    return;
-                  }
-                  break;
-                case VCSEC_OperationStatus_E_OPERATIONSTATUS_WAIT:
-                  if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
-                  {
-                    ESP_LOGW(TAG, "[%s] Received VCSEC WAIT message, requeuing command..", current_command.execute_name.c_str());
-                    current_command.last_tx_at = millis();
-                    current_command.state = BLECommandState::READY;
-                  }
-                  break;
-                case VCSEC_OperationStatus_E_OPERATIONSTATUS_ERROR:
-                  ESP_LOGW(TAG, "[%s] Received VCSEC ERROR message, retrying command..", current_command.execute_name.c_str());
-                  if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
-                  {
-                    current_command.state = BLECommandState::READY;
-                  }
-                  break;
-                }
-              }
-              command_queue_.front() = current_command;
+              this->messageSent(chunk.message, chunk.message_length);
             }
-            break;
-          }
-          case VCSEC_FromVCSECMessage_whitelistInfo_tag:
-          {
-            ESP_LOGD(TAG, "Received whitelist info");
-            break;
-          }
-          case VCSEC_FromVCSECMessage_whitelistEntryInfo_tag:
-          {
-            ESP_LOGD(TAG, "Received whitelist entry info");
-            break;
-          }
-          case VCSEC_FromVCSECMessage_nominalError_tag:
-          {
-            ESP_LOGE(TAG, "Received nominal error");
-            ESP_LOGE(TAG, "  error: %s", generic_error_to_string(vcsec_message.sub_message.nominalError.genericError));
-            break;
+            this->ble_tx_awaiting_ = 0;
           }
-          default:
+          break;
+        case BLEGattEventType::WRITE_FAILED:
+          if (this->ble_tx_awaiting_ != 0)
           {
-            // probably information request with public key
-            VCSEC_InformationRequest info_message = VCSEC_InformationRequest_init_default;
-            int return_code = tesla_ble_client_->parseVCSECInformationRequest(&read_queue_message_.payload.protobuf_message_as_bytes, &info_message);
-            if (return_code != 0)
-            {
-              ESP_LOGE(TAG, "Failed to parse incoming VSSEC message");
-              return;
-            }
-            ESP_LOGD(TAG, "Parsed VCSEC InformationRequest message");
-            // log received public key
-            ESP_LOGD(TAG, "InformationRequest public key: %s", format_hex(info_message.key.publicKey.bytes, info_message.key.publicKey.size).c_str());
-            return;
+            this->retransmitBLE();
           }
           break;
+        case BLEGattEventType::CONNECTED:
+          publishSensor (NumericSensorId::BleDisconnectedTime, 0);
+          publishSensor (NumericSensorId::BlePhy, 1); // Every connection starts on the 1M PHY
+          break;
+        case BLEGattEventType::CLOSED:
+          if ((ble_disconnected_min_time_ == 0) and (ble_disconnected_ == BleDisconnected))
+          { // If delay time zero, then set Unknown on any disconnect however fleeting
+            this->setSensors(false);
+            ble_disconnected_ = BleDisconnectedUnknownsSet;
           }
           break;
+        case BLEGattEventType::PHY:
+          publishSensor (NumericSensorId::BlePhy, event.value);
+          break;
+        case BLEGattEventType::DATA_LENGTH:
+          publishSensor (NumericSensorId::BleDataLength, event.value);
+          break;
         }
+      }
+    }
 
-        case UniversalMessage_Domain_DOMAIN_INFOTAINMENT:
-        {
-          UniversalMessage_MessageFault_E fault = UniversalMessage_MessageFault_E_MESSAGEFAULT_ERROR_NONE;
-          static_carserver_response_ = CarServer_Response_init_default;
-          int return_code = tesla_ble_client_->parsePayloadCarServerResponse(&read_queue_message_.payload.protobuf_message_as_bytes, &read_queue_message_.sub_sigData.signature_data, 1, fault, &static_carserver_response_);
+    void TeslaBLEVehicle::process_ble_read_queue()
+    { // Parse every message that has been reassembled, a burst of responses can complete several in one notification
+      if (this->ble_rx_ring_.dropped() != this->ble_rx_dropped_published_)
+      {
+        this->ble_rx_dropped_published_ = this->ble_rx_ring_.dropped();
+        publishSensor (NumericSensorId::BleRxDropped, this->ble_rx_dropped_published_);
+      }
+
+      BLERXFrame frame;
+      while (!response_queue_.full() and this->ble_rx_ring_.front(frame))
+      { // Decode straight into a free response slot, if there isn't one the message waits in the RX ring
+        ESP_LOGD(TAG, "BLE RX: %s", format_hex(this->ble_rx_ring_.data(frame), frame.length).c_str());
+
+        BLEResponse &response = response_queue_.back();
+        response.message = UniversalMessage_RoutableMessage_init_default;
+        response.received_at = millis();
+        int return_code = tesla_ble_client_->parseUniversalMessageBLE (const_cast<unsigned char *>(this->ble_rx_ring_.data(frame)), frame.length, &response.message);
+        this->ble_rx_ring_.release();
+        if (return_code != 0)
+        {
+          ESP_LOGW(TAG, "BLE RX: Failed to parse incoming message");
+          continue;
+        }
+        ESP_LOGD(TAG, "BLE RX: Parsed UniversalMessage");
+
+        response_queue_.push();
+      }
+    }
+
+    bool BLERXRing::append(const unsigned char *data, size_t length, uint32_t now)
+    /*
+    *   Adds a notification to the message being reassembled, handing every message it completes to the loop. Each message
+    *   takes exactly its 2 byte length prefix plus that many bytes, anything after it starts the next. A message that stops
+    *   arriving for longer than the timeout is dropped, and after an implausible length prefix (an empty message or one
+    *   too large for the ring) bytes are skipped until a plausible one is found. Returns false if there was no room.
+    */
+    {
+      if ((partial_ != 0) and ((now - partial_at_) > timeout_))
+      {
+        ESP_LOGW(TAG, "BLE RX: Rest of message didn't arrive, dropping what there was of it");
+        drop();
+      }
+      partial_at_ = now;
+      while (length != 0)
+      {
+        size_t wanted = (frame_length_ == 0) ? 2 - partial_ : frame_length_ - partial_;
+        size_t taken = std::min(wanted, length);
+        if (!reserve(partial_ + taken))
+        {
+          drop();
+          return false;
+        }
+        unsigned char *frame = buffer_ + (written_ % RX_RING_SIZE);
+        memcpy(frame + partial_, data, taken);
+        partial_ += taken;
+        data += taken;
+        length -= taken;
+
+        if ((frame_length_ == 0) and (partial_ == 2))
+        {
+          size_t message_length = (frame[0] << 8) | frame[1];
+          if ((message_length == 0) or (message_length + 2 > MAX_BLE_MESSAGE_SIZE))
+          { // Part way into a message whose start was lost, skip a byte and look again
+            if (!resyncing_)
+            {
+              ESP_LOGW(TAG, "BLE RX: Implausible message length %d, looking for the start of the next message", message_length);
+              dropped_.fetch_add(1, std::memory_order_relaxed);
+              resyncing_ = true;
+            }
+            frame[0] = frame[1];
+            partial_ = 1;
+            continue;
+          }
+          resyncing_ = false;
+          frame_length_ = 2 + message_length;
+        }
+        if ((frame_length_ != 0) and (partial_ == frame_length_))
+        {
+          ESP_LOGD(TAG, "BLE RX: Reassembled message of %d bytes", frame_length_);
+          written_ += frame_length_;
+          completed_.store(written_, std::memory_order_release); // It stays in the ring until the loop has parsed it
+          partial_ = 0;
+          frame_length_ = 0;
+        }
+        else if (length == 0)
+        {
+          ESP_LOGD(TAG, "BLE RX: Buffered chunk, waiting for more data.. (%d/%d)", partial_, frame_length_);
+        }
+      }
+      return true;
+    }
+
+    bool BLERXRing::reserve(size_t length)
+    /*
+    *   Makes sure the message being reassembled has length contiguous bytes. If it would run off the end of the ring, what
+    *   there is of it is moved to the start and the bytes skipped are released along with it. A zero length prefix is left
+    *   where it was, if there's room, so the loop knows to skip them too.
+    */
+    {
+      size_t start = written_ % RX_RING_SIZE;
+      if (start + length <= RX_RING_SIZE)
+      {
+        return used() + length <= RX_RING_SIZE;
+      }
+      size_t skip = RX_RING_SIZE - start;
+      if (used() + skip + length > RX_RING_SIZE)
+      {
+        return false;
+      }
+      memmove(buffer_, buffer_ + start, partial_);
+      if (skip >= 2)
+      {
+        buffer_[start] = 0;
+        buffer_[start + 1] = 0;
+      }
+      written_ += skip;
+      return true;
+    }
+
+    void BLERXRing::drop()
+    { // Throw away the message being reassembled
+      if ((partial_ != 0) and !resyncing_)
+      {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+      }
+      partial_ = 0;
+      frame_length_ = 0;
+    }
+
+    void BLERXRing::reset()
+    { // A message can't continue on a new connection, and complete ones not yet parsed are dropped by discard_stale
+      partial_ = 0;
+      frame_length_ = 0;
+      resyncing_ = false;
+      stale_.store(completed_.load(std::memory_order_relaxed), std::memory_order_release);
+    }
+
+    void BLERXRing::discard_stale()
+    { // Hands back every message completed before the last disconnect, but none that has arrived since
+      size_t position = released_.load(std::memory_order_relaxed);
+      size_t stale = stale_.load(std::memory_order_acquire);
+      if ((stale - position) <= (completed_.load(std::memory_order_acquire) - position))
+      {
+        released_.store(stale, std::memory_order_release);
+      }
+    }
+
+    bool BLERXRing::front(BLERXFrame &frame) const
+    { // Finds the oldest complete message not yet released, if there is one
+      size_t position = released_.load(std::memory_order_relaxed);
+      if (position == completed_.load(std::memory_order_acquire))
+      {
+        return false;
+      }
+      frame.offset = position % RX_RING_SIZE;
+      frame.skip = 0;
+      if ((RX_RING_SIZE - frame.offset < 2) or ((buffer_[frame.offset] == 0) and (buffer_[frame.offset + 1] == 0)))
+      { // Skipped to keep the message contiguous, a real message is never empty
+        frame.skip = RX_RING_SIZE - frame.offset;
+        frame.offset = 0;
+      }
+      frame.length = 2 + ((buffer_[frame.offset] << 8) | buffer_[frame.offset + 1]);
+      return true;
+    }
+
+    void BLERXRing::release()
+    { // Hand back the oldest message's space once it has been parsed
+      BLERXFrame frame;
+      if (!front(frame))
+      {
+        return;
+      }
+      released_.fetch_add(frame.skip + frame.length, std::memory_order_release);
+    }
+
+    void TeslaBLEVehicle::process_response_queue()
+    {
+      if (response_queue_.empty())
+      {
+        return;
+      }
+      handleResponse(response_queue_.front().message);
+      response_queue_.pop();
+    }
+
+    void TeslaBLEVehicle::handleResponse(UniversalMessage_RoutableMessage &message)
+    {
+      //log_routable_message (TAG, &message);
+
+      if (not message.has_from_destination)
+      {
+        ESP_LOGD(TAG, "[x] Dropping message with missing source");
+        return;
+      }
+
+      if ((message.request_uuid.size != 0) && (message.request_uuid.size != 16))
+      {
+        ESP_LOGW(TAG, "[x] Dropping message with invalid request UUID length");
+        return;
+      }
+      std::string request_uuid_hex_string = format_hex(message.request_uuid.bytes, message.request_uuid.size);
+      const char *request_uuid_hex = request_uuid_hex_string.c_str();
+
+      if (not message.has_to_destination)
+      {
+        ESP_LOGW(TAG, "[%s] Dropping message with missing destination", request_uuid_hex);
+        return;
+      }
+
+      switch (message.to_destination.which_sub_destination)
+      {
+      case UniversalMessage_Destination_domain_tag:
+      {
+        ESP_LOGD(TAG, "[%s] Dropping message to %s", request_uuid_hex, domain_to_string(message.from_destination.sub_destination.domain));
+        return;
+      }
+      case UniversalMessage_Destination_routing_address_tag:
+      {
+        // Continue
+        ESP_LOGD(TAG, "Continuing message with routing address");
+        break;
+      }
+      default:
+      {
+        ESP_LOGW(TAG, "[%s] Dropping message with unrecognized destination type, %d", request_uuid_hex, message.to_destination.which_sub_destination);
+        return;
+      }
+      }
+
+      if (message.to_destination.sub_destination.routing_address.size != 16)
+      {
+        ESP_LOGW(TAG, "[%s] Dropping message with invalid address length", request_uuid_hex);
+        return;
+      }
+      noteAnswered(); // Whatever it says, the car is within reach
+      if (message.has_signedMessageStatus)
+      {
+        if (message.signedMessageStatus.operation_status == UniversalMessage_OperationStatus_E_OPERATIONSTATUS_ERROR)
+        {
+          // reset authentication for domain
+//          auto session = tesla_ble_client_->getPeer(message.from_destination.sub_destination.domain);
+          invalidateSession(message.from_destination.sub_destination.domain);
+        }
+      }
+
+      if (message.which_payload == UniversalMessage_RoutableMessage_session_info_tag)
+      {
+        int return_code = this->handleSessionInfoUpdate(message, message.from_destination.sub_destination.domain);
+        if (return_code != 0)
+        {
+          ESP_LOGE(TAG, "Failed to handle session info update");
+          return;
+        }
+        ESP_LOGI(TAG, "[%s] Updated session info for %s", request_uuid_hex, domain_to_string(message.from_destination.sub_destination.domain));
+      }
+
+      if (message.has_signedMessageStatus)
+      {
+        ESP_LOGD(TAG, "Received signed message status from domain %s", domain_to_string(message.from_destination.sub_destination.domain));
+        log_message_status(TAG, &message.signedMessageStatus);
+        if (message.signedMessageStatus.operation_status == UniversalMessage_OperationStatus_E_OPERATIONSTATUS_ERROR)
+        {
+          ESP_LOGE(TAG, "Received error message from domain %s", domain_to_string(message.from_destination.sub_destination.domain));
+          return;
+        }
+        else if ((message.signedMessageStatus.operation_status == UniversalMessage_OperationStatus_E_OPERATIONSTATUS_WAIT) or
+                 (message.signedMessageStatus.signed_message_fault == UniversalMessage_MessageFault_E_MESSAGEFAULT_ERROR_BUSY))
+        {
+          ESP_LOGI(TAG, "Received wait message from domain %s", domain_to_string(message.from_destination.sub_destination.domain));
+          carBusy(message.from_destination.sub_destination.domain,
+                  command_queue_.find_request(message.request_uuid.bytes, message.request_uuid.size, message.from_destination.sub_destination.domain));
+          return;
+        }
+        else
+        {
+          ESP_LOGI(TAG, "Received success message from domain %s", domain_to_string(message.from_destination.sub_destination.domain));
+        }
+        return;
+      }
+
+      if (message.which_payload == UniversalMessage_RoutableMessage_session_info_tag)
+      {
+        // log error and return if session info is present
+        return;
+      }
+
+      log_routable_message(TAG, &message);
+      switch (message.from_destination.which_sub_destination)
+      {
+      case UniversalMessage_Destination_domain_tag:
+      {
+        ESP_LOGD(TAG, "Received message from domain %s", domain_to_string(message.from_destination.sub_destination.domain));
+        switch (message.from_destination.sub_destination.domain)
+        {
+        case UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY:
+        {
+          VCSEC_FromVCSECMessage vcsec_message = VCSEC_FromVCSECMessage_init_default;
+          int return_code = tesla_ble_client_->parseFromVCSECMessage(&message.payload.protobuf_message_as_bytes, &vcsec_message);
           if (return_code != 0)
           {
             ESP_LOGE(TAG, "Failed to parse incoming message");
             return;
           }
-          if (fault != UniversalMessage_MessageFault_E_MESSAGEFAULT_ERROR_NONE)
+          ESP_LOGD(TAG, "Parsed VCSEC message, which_sub_message = %i", vcsec_message.which_sub_message);
+
+          switch (vcsec_message.which_sub_message)
           {
-            ESP_LOGW (TAG, "Parsed CarServer.Response but fault code was %s", message_fault_to_string(fault));
-          }
-            //log_routable_message(TAG, &message);
-          log_carserver_response(TAG, &static_carserver_response_);
-          if (static_carserver_response_.has_actionStatus && !command_queue_.empty())
+          case VCSEC_FromVCSECMessage_vehicleStatus_tag:
           {
-            BLECommand current_command = command_queue_.front();
-            if (current_command.domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT)
+            ESP_LOGD(TAG, "Received vehicle status");
+            handleVCSECVehicleStatus(vcsec_message.sub_message.vehicleStatus);
+
+            // Either lane's head may be waiting on it
+            int index = command_queue_.head(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+            if (index >= 0)
             {
-              switch (static_carserver_response_.actionStatus.result)
+              BLECommand &current_command = command_queue_.at(index);
+              if ((current_command.state == BLECommandState::WAITING_FOR_RESPONSE) and (current_command.detail().onStatus != StatusCompletion::NEVER))
               {
-              case CarServer_OperationStatus_E_OPERATIONSTATUS_OK:
-                handleInfoCarServerResponse (static_carserver_response_);
-                if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
+                ESP_LOGI(TAG, "[%s] Received vehicle status, command completed", current_command.name());
+                commandAnswered(current_command, UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+                finishCommand(index, BLECommandOutcome::SUCCESS);
+              }
+            }
+            index = command_queue_.head(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+            if (index >= 0)
+            {
+              BLECommand &current_command = command_queue_.at(index);
+              switch (current_command.state)
+              {
+              case BLECommandState::WAITING_FOR_WAKE:
+              case BLECommandState::WAITING_FOR_WAKE_RESPONSE:
+                switch (vcsec_message.sub_message.vehicleStatus.vehicleSleepStatus)
                 {
-                  ESP_LOGI(TAG, "[%s] Received CarServer OK message, command completed", current_command.execute_name.c_str());
-                  /*
-                  *   If command was an action message, then set to request an update for its associated data (not immediately
-                  *   in order to give time for the command to complete)
-                  */
-                  if (get_action_detail(current_command.action).whichMsg == AllowedMsg::VehicleActionMessage)
+                case VCSEC_VehicleSleepStatus_E_VEHICLE_SLEEP_STATUS_AWAKE:
+                  if (current_command.detail().doneWhenAwake)
                   {
-                    current_command.state = BLECommandState::WAITING_FOR_GET_POST_SET;
+                    ESP_LOGI(TAG, "[%s] Received vehicle status, command completed", current_command.name());
+                    finishCommand(index, BLECommandOutcome::SUCCESS);
+                    return;
                   }
                   else
                   {
-                    command_queue_.pop();
-                    return;
+                    ESP_LOGI(TAG, "[%s] Received vehicle status, vehicle is awake", current_command.name());
+                    current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
+                    current_command.retry_count = 0;
                   }
+                  break;
+                default:
+                  ESP_LOGD(TAG, "[%s] Received vehicle status, vehicle is not awake", current_command.name());
+                  break;
                 }
                 break;
-              case CarServer_OperationStatus_E_OPERATIONSTATUS_ERROR:
-                // if charging switch is turned on and reason = "is_charging" it's OK
-                // if charging switch is turned off and reason = "is_not_charging" it's OK
-                if (static_carserver_response_.actionStatus.has_result_reason)
+
+              case BLECommandState::WAITING_FOR_RESPONSE:
+                if (current_command.detail().onStatus != StatusCompletion::NEVER)
+                { // It sent a VCSEC information request
+                  commandAnswered(current_command, UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+                }
+                if (current_command.detail().onStatus == StatusCompletion::ALWAYS)
                 {
-                  switch (static_carserver_response_.actionStatus.result_reason.which_reason)
+                  ESP_LOGI(TAG, "[%s] Received vehicle status, command completed", current_command.name());
+                  finishCommand(index, BLECommandOutcome::SUCCESS);
+                  return;
+                }
+                else if (current_command.detail().onStatus == StatusCompletion::WHEN_AWAKE)
+                {
+                  switch (vcsec_message.sub_message.vehicleStatus.vehicleSleepStatus)
                   {
-                  case CarServer_ResultReason_plain_text_tag:
-                    if ((strcmp(static_carserver_response_.actionStatus.result_reason.reason.plain_text, "is_charging") == 0) ||
-                        (strcmp(static_carserver_response_.actionStatus.result_reason.reason.plain_text, "is_not_charging") == 0))
-                    {
-                      ESP_LOGD(TAG, "[%s] Received charging status: %s", current_command.execute_name.c_str(), static_carserver_response_.actionStatus.result_reason.reason.plain_text);
-                      if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
-                      {
-                        ESP_LOGI(TAG, "[%s] Received CarServer OK message, command completed", current_command.execute_name.c_str());
-                        command_queue_.pop();
-                        return;
-                      }
-                    }
-                    break;
+                  case VCSEC_VehicleSleepStatus_E_VEHICLE_SLEEP_STATUS_AWAKE:
+                    ESP_LOGI(TAG, "[%s] Received vehicle status, command completed", current_command.name());
+                    finishCommand(index, BLECommandOutcome::SUCCESS);
+                    return;
                   default:
-                    break;
+                    ESP_LOGD(TAG, "[%s] Received vehicle status, infotainment is not awake", current_command.name());
+                    invalidateSession(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+                    current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
                   }
                 }
-                else
+                break;
+              default:
+                break;
+              }
+            }
+            break;
+          }
+          case VCSEC_FromVCSECMessage_commandStatus_tag:
+          {
+            ESP_LOGD(TAG, "Received VCSEC command status");
+            log_vcsec_command_status(TAG, &vcsec_message.sub_message.commandStatus);
+            // By UUID, as a wake sent for the infotainment lane is answered too
+            int index = command_queue_.find_request(message.request_uuid.bytes, message.request_uuid.size, UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+            if (index >= 0)
+            {
+              BLECommand &current_command = command_queue_.at(index);
+              commandAnswered(current_command, UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+              switch (vcsec_message.sub_message.commandStatus.operationStatus)
+              {
+              case VCSEC_OperationStatus_E_OPERATIONSTATUS_OK:
+                if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
                 {
-                  ESP_LOGE(TAG, "[%s] Received CarServer ERROR message, retrying command..", current_command.execute_name.c_str());
-                  if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
-                  {
-                    current_command.state = BLECommandState::READY;
-                  }
+                  ESP_LOGI(TAG, "[%s] Received VCSEC OK message, command completed", current_command.name());
+                  finishCommand(index, BLECommandOutcome::SUCCESS);
+                  return;
+                }
+                break;
+              case VCSEC_OperationStatus_E_OPERATIONSTATUS_WAIT:
+                ESP_LOGW(TAG, "[%s] Received VCSEC WAIT message, requeuing command..", current_command.name());
+                carBusy(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY, index);
+                break;
+              case VCSEC_OperationStatus_E_OPERATIONSTATUS_ERROR:
+                ESP_LOGW(TAG, "[%s] Received VCSEC ERROR message, retrying command..", current_command.name());
+                if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
+                {
+                  current_command.state = BLECommandState::READY;
                 }
                 break;
               }
             }
-            command_queue_.front() = current_command;
+            break;
+          }
+          case VCSEC_FromVCSECMessage_whitelistInfo_tag:
+          {
+            ESP_LOGD(TAG, "Received whitelist info");
+            break;
           }
+          case VCSEC_FromVCSECMessage_whitelistEntryInfo_tag:
+          {
+            ESP_LOGD(TAG, "Received whitelist entry info");
+            break;
+          }
+          case VCSEC_FromVCSECMessage_nominalError_tag:
+          {
+            ESP_LOGE(TAG, "Received nominal error");
+            ESP_LOGE(TAG, "  error: %s", generic_error_to_string(vcsec_message.sub_message.nominalError.genericError));
+            break;
+          }
+          default:
+          {
+            // probably information request with public key
+            VCSEC_InformationRequest info_message = VCSEC_InformationRequest_init_default;
+            int return_code = tesla_ble_client_->parseVCSECInformationRequest(&message.payload.protobuf_message_as_bytes, &info_message);
+            if (return_code != 0)
+            {
+              ESP_LOGE(TAG, "Failed to parse incoming VSSEC message");
+              return;
+            }
+            ESP_LOGD(TAG, "Parsed VCSEC InformationRequest message");
+            // log received public key
+            ESP_LOGD(TAG, "InformationRequest public key: %s", format_hex(info_message.key.publicKey.bytes, info_message.key.publicKey.size).c_str());
+            return;
+          }
+          break;
+          }
+          break;
+        }
+
+        case UniversalMessage_Domain_DOMAIN_INFOTAINMENT:
+        {
+          UniversalMessage_MessageFault_E fault = UniversalMessage_MessageFault_E_MESSAGEFAULT_ERROR_NONE;
+          static_carserver_response_ = CarServer_Response_init_default;
+          int return_code = tesla_ble_client_->parsePayloadCarServerResponse(&message.payload.protobuf_message_as_bytes, &message.sub_sigData.signature_data, 1, fault, &static_carserver_response_);
+          if (return_code != 0)
+          {
+            ESP_LOGE(TAG, "Failed to parse incoming message");
+            return;
+          }
+          if (fault != UniversalMessage_MessageFault_E_MESSAGEFAULT_ERROR_NONE)
+          {
+            ESP_LOGW (TAG, "Parsed CarServer.Response but fault code was %s", message_fault_to_string(fault));
+            if (fault == UniversalMessage_MessageFault_E_MESSAGEFAULT_ERROR_BUSY)
+            {
+              carBusy(UniversalMessage_Domain_DOMAIN_INFOTAINMENT,
+                      command_queue_.find_request(message.request_uuid.bytes, message.request_uuid.size, UniversalMessage_Domain_DOMAIN_INFOTAINMENT));
+              return;
+            }
+          }
+            //log_routable_message(TAG, &message);
+          log_carserver_response(TAG, &static_carserver_response_);
+          if (static_carserver_response_.has_actionStatus)
+          {
+            int index = command_queue_.find_request(message.request_uuid.bytes, message.request_uuid.size, UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+            if (index < 0)
+            { // Nothing is waiting for it but any data it holds is still current
+              ESP_LOGD(TAG, "[%s] No command waiting for CarServer response", request_uuid_hex);
+              if (static_carserver_response_.actionStatus.result == CarServer_OperationStatus_E_OPERATIONSTATUS_OK)
+              {
+                handleInfoCarServerResponse (static_carserver_response_);
+              }
+            }
+            else
+            {
+              BLECommand &current_command = command_queue_.at(index);
+              commandAnswered(current_command, UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+              switch (static_carserver_response_.actionStatus.result)
+              {
+              case CarServer_OperationStatus_E_OPERATIONSTATUS_OK:
+                handleInfoCarServerResponse (static_carserver_response_);
+                if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
+                {
+                  ESP_LOGI(TAG, "[%s] Received CarServer OK message, command completed", current_command.name());
+                  /*
+                  *   If command was an action message, then set to request an update for its associated data (not immediately
+                  *   in order to give time for the command to complete)
+                  */
+                  if (get_action_detail(current_command.action).whichMsg == AllowedMsg::VehicleActionMessage)
+                  { // The car has done it, only the follow up get is left
+                    current_command.state = BLECommandState::WAITING_FOR_GET_POST_SET;
+                    reportCommand(current_command, BLECommandOutcome::SUCCESS);
+                  }
+                  else
+                  {
+                    finishCommand(index, BLECommandOutcome::SUCCESS);
+                    return;
+                  }
+                }
+                break;
+              case CarServer_OperationStatus_E_OPERATIONSTATUS_ERROR:
+                // if charging switch is turned on and reason = "is_charging" it's OK
+                // if charging switch is turned off and reason = "is_not_charging" it's OK
+                if (static_carserver_response_.actionStatus.has_result_reason)
+                {
+                  switch (static_carserver_response_.actionStatus.result_reason.which_reason)
+                  {
+                  case CarServer_ResultReason_plain_text_tag:
+                    if ((strcmp(static_carserver_response_.actionStatus.result_reason.reason.plain_text, "is_charging") == 0) ||
+                        (strcmp(static_carserver_response_.actionStatus.result_reason.reason.plain_text, "is_not_charging") == 0))
+                    {
+                      ESP_LOGD(TAG, "[%s] Received charging status: %s", current_command.name(), static_carserver_response_.actionStatus.result_reason.reason.plain_text);
+                      if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
+                      {
+                        ESP_LOGI(TAG, "[%s] Received CarServer OK message, command completed", current_command.name());
+                        finishCommand(index, BLECommandOutcome::SUCCESS);
+                        return;
+                      }
+                    }
+                    break;
+                  default:
+                    break;
+                  }
+                }
+                else
+                {
+                  ESP_LOGE(TAG, "[%s] Received CarServer ERROR message, retrying command..", current_command.name());
+                  if (current_command.state == BLECommandState::WAITING_FOR_RESPONSE)
+                  {
+                    current_command.state = BLECommandState::READY;
+                  }
+                }
+                break;
+              }
+            }
+          }
+          break;
+        }
+        default:
+        {
+          ESP_LOGD(TAG, "Received message for %s", domain_to_string(message.to_destination.sub_destination.domain));
+          ESP_LOGD(TAG, "Received message from unknown domain %s", domain_to_string(message.from_destination.sub_destination.domain));
+          break;
+        }
+        break;
+        }
+        break;
+      }
+
+      case UniversalMessage_Destination_routing_address_tag:
+      {
+        ESP_LOGD(TAG, "Received message from routing address");
+        break;
+      }
+      default:
+      {
+        ESP_LOGD(TAG, "Received message from unknown domain %s", domain_to_string(message.from_destination.sub_destination.domain));
+        break;
+      }
+      break;
+      }
+    }
+
+    void TeslaBLEVehicle::loop()
+    {
+      process_gatt_events(); // Even when not connected, so a disconnect is applied
+      if (this->node_state != espbt::ClientState::ESTABLISHED)
+      {
+        if (!command_queue_.empty())
+        {
+          // clear command queue if not connected or on first boot (prevent restore value triggering commands)
+          finishCommand(0, BLECommandOutcome::FAILURE);
+        }
+        return;
+      }
+      process_ble_read_queue();
+      process_response_queue();
+      process_wake();
+      process_command_queue();
+      process_pipelined_commands();
+      process_ble_write_queue();
+    }
+
+    void TeslaBLEVehicle::update()
+    {
+      ESP_LOGD(TAG, "Updating Tesla BLE Vehicle component, command queue size is %d ..", command_queue_.size());
+      /*
+      *   When the car departs, the node_state is no longer established so the main loop isn't entered and any timeouts in there
+      *   are no longer available. Therefore have to handle disconnections outside of the main loop.
+      */
+      if (ble_disconnected_min_time_ != 0)
+      { // Only delay setting to Unknown if not zero
+        if ((ble_disconnected_ == BleDisconnected) and ((millis() - ble_disconnected_time_) > ble_disconnected_min_time_))
+        { // Only make sensors Unknown if ble disconnected continuously for the configured time
+          this->setSensors(false);
+          ble_disconnected_ = BleDisconnectedUnknownsSet;
+        }
+      }
+
+if (ble_disconnected_ != BleConnected) // While disconnected update duration of disconnection
+{
+  publishSensor (NumericSensorId::BleDisconnectedTime, (millis() - ble_disconnected_time_) / 1000);
+}
+
+      if (this->node_state == espbt::ClientState::ESTABLISHED)
+      {
+        ESP_LOGD(TAG, "Querying vehicle status update..");
+        publishBreakerState(); // Also puts it back after a long disconnection set it to Unknown
+        enqueueVCSECInformationRequest();
+        /*
+        *	INFOTAINMENT data can only be collected when the car is awake, while VCSEC data also when the car is asleep.
+        *	Therefore we trigger polling for INFOTAINMENT data under the following circumstances:
+        *	- on startup. This might wake the car but we want the entities to have initial values.
+        *	- whenever the car wakes up. However, depending on the wake:
+        *	  - if the car woke up of its own accord, poll for post_wake_poll_time s every poll_data_period s and allow the car to
+        *     go back to sleep.
+        *	  - if the car was woken by someone getting in the car (door unlocked or user present), or the car is charging,
+        *     then poll continuously at update_interval to have the data as up to date as possible (eg shift state which some people
+        *		  want to use to trigger the opening of their electric gate) until the trigger state ends.
+        *   - Otherwise we poll the Infotainment system every poll_asleep_period s in case the car was charging, charging then stops
+        *     but resumes while the car has been awake continuously (otherwise we would never notice it's charging again). This period
+        *     should be chosen to be long enough so that the car will fall asleep if nothing else is happening to keep it awake.
+        */
+        switch (esp32_just_started_)
+        {
+        case 2:
+          // If the ESP32 has just started and wake on boot wanted, wake car even if already awake to get an initial poll of its data
+          if (wake_on_boot_ > 0)
+          {
+            wakeVehicle(); // wake will cause poll assuming car available
+          }
+          esp32_just_started_++;
+          ESP_LOGI (TAG, "Polling parameters: post_wake_poll_time_ %i, poll_data_period_  %i, poll_asleep_period_ %i, poll_charging_period_  %i, ble_disconnected_min_time_  %i, fast_poll_if_unlocked_ %i, wake_on_boot_ %i",
+            post_wake_poll_time_,
+            poll_data_period_,
+            poll_asleep_period_,
+            poll_charging_period_,
+            ble_disconnected_min_time_,
+            fast_poll_if_unlocked_,
+            wake_on_boot_);
+          break;
+        case 0:
+        case 1:
+          esp32_just_started_++;
+        // Beyond 2 this is no longer relevant
+        }
+        if (!binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state and previous_asleep_state_) // Remember, true means asleep
+        {
+          // Car has just woken, also record time it happened so can time out after configured time
+          car_just_woken_ = 1;
+          car_wake_time_ = millis();
+        }
+        if (binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state and !previous_asleep_state_) // Car has just gone to sleep
+        { // Belt & braces clear poll triggers if car is asleep
+          car_is_charging_ = NotCharging;
+        }
+        previous_asleep_state_ = binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state;
+
+        ESP_LOGI (TAG, "Reading INFOTAINMENT, previous_asleep_state_=%d, car_just_woken_=%d, car_is_charging_=%d, Unlocked=%d, User=%d, fast_poll_if_unlocked_=%d",
+                  previous_asleep_state_, car_just_woken_, car_is_charging_, binary_sensors_[static_cast<size_t>(BinarySensorId::IsUnlocked)]->state, binary_sensors_[static_cast<size_t>(BinarySensorId::IsUserPresent)]->state, fast_poll_if_unlocked_);
+        
+        //if (car_just_woken_ or OneOffUpdate or car_is_charging_ or this->is_unlocked_->state or this->is_user_present_->state)
+        if (one_off_update_ or (binary_sensors_[static_cast<size_t>(BinarySensorId::IsUnlocked)]->state and (fast_poll_if_unlocked_ > 0)) or binary_sensors_[static_cast<size_t>(BinarySensorId::IsUserPresent)]->state)
+        { // For these fastest poll rate is used
+          do_poll_ = true;
+        }
+        else if (car_is_charging_ != NotCharging)
+        { // otherwise charging polls have priority
+          if (car_is_charging_ == ChargingJustStarted)
+          { // Do a poll as soon as notice car is charging
+            do_poll_ = true;
+            car_is_charging_ = ChargingOngoing;
+          }
+          else if (((millis() - last_infotainment_poll_time_) > poll_charging_period_))
+          { // subsequent polls on the configured repeat period
+            do_poll_ = true;
+          }
+        }
+        else if (car_just_woken_ != 0)
+        { // Just woken polls lower priority
+          if (car_just_woken_ == 1)
+          { // Do a poll as soon as the car awakes
+            do_poll_ = true;
+            car_just_woken_ = 2;
+          }
+          else if ((millis() - last_infotainment_poll_time_) > poll_data_period_)
+          { // subsequent polls on the configured repeat period
+            do_poll_ = true;
+          }
+        }
+        else if (poll_asleep_period_ != 0)
+        { // Try slower polls even when car is asleep unless set to 0
+          if ((millis() - last_infotainment_poll_time_) > poll_asleep_period_)
+          {
+            do_poll_ = true;
+          }
+        }
+        if (do_poll_)
+        {
+          // Start retrieval of data from car. Each data type has its own frequency, everything due goes in one message.
+          last_infotainment_poll_time_ = millis();
+          uint32_t categories = 0;
+          for (auto action : {BLE_CarServer_VehicleAction::GET_CHARGE_STATE, BLE_CarServer_VehicleAction::GET_DRIVE_STATE,
+                              BLE_CarServer_VehicleAction::GET_CLIMATE_STATE, BLE_CarServer_VehicleAction::GET_CLOSURES_STATE,
+                              BLE_CarServer_VehicleAction::GET_TYRES_STATE})
+          {
+            if ((number_updates_since_connection_ % get_action_detail(action).numberUpdatesBetweenGets) == 0)
+              categories |= vehicle_data_bit(action);
+          }
+          if (categories != 0)
+            requestVehicleData (categories);
+          if ((car_just_woken_ != 0) and ((millis() - car_wake_time_) > post_wake_poll_time_))
+          {
+            car_just_woken_ = 0;
+          }
+          one_off_update_ = false; // Clear once a single cycle of data collection completed
+          do_poll_ = false;
+          number_updates_since_connection_++;
+        }
+        return;
+      }
+    }
+
+    int TeslaBLEVehicle::nvs_save_session_info(const Signatures_SessionInfo &session_info, const UniversalMessage_Domain domain)
+    {
+      ESP_LOGD(TAG, "Storing updated session info in NVS for domain %s", domain_to_string(domain));
+      const char *nvs_key = (domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) ? nvs_key_infotainment : nvs_key_vcsec;
+
+      // Estimate required buffer size
+      size_t session_info_encode_buffer_size = Signatures_SessionInfo_size + 10; // Add some padding
+      std::vector<pb_byte_t> session_info_encode_buffer(session_info_encode_buffer_size);
+
+      // Encode session info into protobuf message
+      int return_code = TeslaBLE::pb_encode_fields(session_info_encode_buffer.data(), &session_info_encode_buffer_size, Signatures_SessionInfo_fields, &session_info);
+      if (return_code != 0)
+      {
+        ESP_LOGE(TAG, "Failed to encode session info for domain %s. Error code: %d", domain_to_string(domain), return_code);
+        return return_code;
+      }
+      ESP_LOGD(TAG, "Session info encoded to %d bytes for domain %s", session_info_encode_buffer_size, domain_to_string(domain));
+      ESP_LOGD(TAG, "Session info: %s", format_hex(session_info_encode_buffer.data(), session_info_encode_buffer_size).c_str());
+
+      // Store encoded session info in NVS
+      esp_err_t err = nvs_set_blob(this->storage_handle_, nvs_key, session_info_encode_buffer.data(), session_info_encode_buffer_size);
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "Failed to set %s key in storage: %s", domain_to_string(domain), esp_err_to_name(err));
+        return static_cast<int>(err);
+      }
+
+      // Commit the changes to NVS
+      err = nvs_commit(this->storage_handle_);
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "Failed to commit storage for domain %s: %s", domain_to_string(domain), esp_err_to_name(err));
+        return static_cast<int>(err);
+      }
+
+      ESP_LOGD(TAG, "Successfully saved session info for domain %s", domain_to_string(domain));
+      return 0;
+    }
+
+    int TeslaBLEVehicle::nvs_load_session_info(Signatures_SessionInfo *session_info, const UniversalMessage_Domain domain)
+    {
+      if (session_info == nullptr)
+      {
+        ESP_LOGE(TAG, "Invalid session_info pointer");
+        return 1;
+      }
+
+      const std::string nvs_key = (domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) ? nvs_key_infotainment : nvs_key_vcsec;
+
+      size_t required_session_info_size = 0;
+      esp_err_t err = nvs_get_blob(this->storage_handle_, nvs_key.c_str(), nullptr, &required_session_info_size);
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "Failed to read %s key size from storage: %s", domain_to_string(domain), esp_err_to_name(err));
+        return 1;
+      }
+
+      std::vector<uint8_t> session_info_protobuf(required_session_info_size);
+      err = nvs_get_blob(this->storage_handle_, nvs_key.c_str(), session_info_protobuf.data(), &required_session_info_size);
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "Failed to read %s key data from storage: %s", domain_to_string(domain), esp_err_to_name(err));
+        return 1;
+      }
+
+      ESP_LOGI(TAG, "Loaded %s session info from NVS", domain_to_string(domain));
+      ESP_LOGD(TAG, "Session info: %s", format_hex(session_info_protobuf.data(), required_session_info_size).c_str());
+
+      pb_istream_t stream = pb_istream_from_buffer(session_info_protobuf.data(), required_session_info_size);
+      if (!pb_decode(&stream, Signatures_SessionInfo_fields, session_info))
+      {
+        ESP_LOGE(TAG, "Failed to decode session info response: %s", PB_GET_ERROR(&stream));
+        return 1;
+      }
+
+      log_session_info(TAG, session_info);
+
+      auto session = tesla_ble_client_->getPeer(domain);
+      session->updateSession(session_info);
+
+      return 0;
+    }
+
+    int TeslaBLEVehicle::nvs_initialize_private_key()
+    {
+      size_t required_private_key_size = 0;
+      int err = nvs_get_blob(this->storage_handle_, "private_key", NULL, &required_private_key_size);
+      ESP_LOGD (TAG, "Required_private_key_size = %d", static_cast<int>(required_private_key_size));
+      if (err != ESP_OK)
+      {
+        ESP_LOGW(TAG, "Failed read private key from storage: %s", esp_err_to_name(err));
+      }
+
+      if (required_private_key_size == 0)
+      {
+        int result_code = tesla_ble_client_->createPrivateKey();
+        if (result_code != 0)
+        {
+          ESP_LOGE(TAG, "Failed create private key");
+          return result_code;
+        }
+
+        unsigned char private_key_buffer[PRIVATE_KEY_SIZE];
+        size_t private_key_length = 0;
+        tesla_ble_client_->getPrivateKey(private_key_buffer, sizeof(private_key_buffer), &private_key_length);
+
+        esp_err_t err = nvs_set_blob(this->storage_handle_, "private_key", private_key_buffer, private_key_length);
+
+        err = nvs_commit(this->storage_handle_);
+        if (err != ESP_OK)
+        {
+          ESP_LOGE(TAG, "Failed commit storage: %s", esp_err_to_name(err));
+        }
+
+        ESP_LOGI(TAG, "Private key successfully created");
+      }
+      else
+      {
+        unsigned char private_key_buffer[required_private_key_size];
+        err = nvs_get_blob(this->storage_handle_, "private_key", private_key_buffer, &required_private_key_size);
+        if (err != ESP_OK)
+        {
+          ESP_LOGE(TAG, "Failed read private key from storage: %s", esp_err_to_name(err));
+          return 1;
+        }
+
+        int result_code = tesla_ble_client_->loadPrivateKey(private_key_buffer, required_private_key_size);
+        if (result_code != 0)
+        {
+          ESP_LOGE(TAG, "Failed load private key");
+          return result_code;
+        }
+
+        ESP_LOGI(TAG, "Private key loaded successfully");
+      }
+      return 0;
+    }
+
+    void TeslaBLEVehicle::set_vin(const char *vin)
+    {
+      tesla_ble_client_->setVIN(vin);
+    }
+
+    void TeslaBLEVehicle::load_polling_parameters (const int post_wake_poll_time, const int poll_data_period,
+                                                   const int poll_asleep_period, const int poll_charging_period,
+                                                   const int ble_disconnected_min_time, const int fast_poll_if_unlocked,
+                                                   const int wake_on_boot)
+    {
+      // All timings are in milliseconds
+      post_wake_poll_time_ = post_wake_poll_time * 1000;
+      poll_data_period_ = poll_data_period * 1000;
+      poll_asleep_period_ = poll_asleep_period * 1000;
+      poll_charging_period_ = poll_charging_period * 1000;
+      ble_disconnected_min_time_ = ble_disconnected_min_time * 1000;
+      fast_poll_if_unlocked_ = fast_poll_if_unlocked;
+      wake_on_boot_ = wake_on_boot;
+    }
+
+    void TeslaBLEVehicle::regenerateKey()
+    {
+      ESP_LOGI(TAG, "Regenerating key");
+      int result_code = tesla_ble_client_->createPrivateKey();
+      if (result_code != 0)
+      {
+        ESP_LOGE(TAG, "Failed create private key");
+        return;
+      }
+
+      unsigned char private_key_buffer[PRIVATE_KEY_SIZE];
+      size_t private_key_length = 0;
+      tesla_ble_client_->getPrivateKey(private_key_buffer, sizeof(private_key_buffer), &private_key_length);
+
+      esp_err_t err = nvs_flash_init();
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "Failed to initialize flash: %s", esp_err_to_name(err));
+      }
+
+      err = nvs_open("storage", NVS_READWRITE, &this->storage_handle_);
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "Failed to open NVS handle: %s", esp_err_to_name(err));
+      }
+
+      err = nvs_set_blob(this->storage_handle_, "private_key", private_key_buffer, private_key_length);
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "Failed commit storage: %s", esp_err_to_name(err));
+      }
+
+      err = nvs_commit(this->storage_handle_);
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "Failed commit storage: %s", esp_err_to_name(err));
+      }
+
+      ESP_LOGI(TAG, "Private key successfully created");
+    }
+
+    int TeslaBLEVehicle::startPair()
+    {
+      ESP_LOGI(TAG, "Starting pairing");
+      if (breaker_.open())
+      { // Commands may get through once the key is added
+        breaker_.close();
+        publishBreakerState();
+      }
+      ESP_LOGI(TAG, "Not authenticated yet, building whitelist message");
+      unsigned char whitelist_message_buffer[VCSEC_ToVCSECMessage_size];
+      size_t whitelist_message_length = 0;
+      // support for wake command will be added to ROLE_CHARGING_MANAGER in a future vehicle firmware update
+      // https://github.com/teslamotors/vehicle-command/issues/232#issuecomment-2181503570
+      // TODO: change back to ROLE_CHARGING_MANAGER when it's supported
+      int return_code = tesla_ble_client_->buildWhiteListMessage(Keys_Role_ROLE_DRIVER, VCSEC_KeyFormFactor_KEY_FORM_FACTOR_CLOUD_KEY, whitelist_message_buffer, &whitelist_message_length);
+      if (return_code != 0)
+      {
+        ESP_LOGE(TAG, "Failed to build whitelist message");
+        return return_code;
+      }
+      ESP_LOGV(TAG, "Whitelist message length: %d", whitelist_message_length);
+
+      return_code = writeBLE(whitelist_message_buffer, whitelist_message_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
+      if (return_code != 0)
+      {
+        ESP_LOGE(TAG, "Failed to send whitelist message");
+        return return_code;
+      }
+      ESP_LOGI(TAG, "Please tap your card on the reader now..");
+      return 0;
+    }
+
+    int TeslaBLEVehicle::sendSessionInfoRequest(UniversalMessage_Domain domain)
+    {
+      unsigned char *message_buffer = reserveBLE();
+      if (message_buffer == nullptr)
+      {
+        return 1;
+      }
+      size_t message_length = 0;
+      int return_code = tesla_ble_client_->buildSessionInfoRequestMessage(domain, message_buffer, &message_length);
+
+      if (return_code != 0)
+      {
+        ESP_LOGE(TAG, "Failed to build whitelist message");
+        return return_code;
+      }
+
+      return_code = writeBLE(message_buffer, message_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE, BLETXPriority::CONTROL);
+      if (return_code != 0)
+      {
+        ESP_LOGE(TAG, "Failed to send SessionInfoRequest");
+        return return_code;
+      }
+      return 0;
+    }
+
+    unsigned char *TeslaBLEVehicle::reserveBLE()
+    /*
+    *   Reserves space in the TX ring for a message to be built into. Pass the returned buffer to writeBLE once built.
+    */
+    {
+      unsigned char *message_buffer = ble_tx_ring_.reserve(UniversalMessage_RoutableMessage_size);
+      ble_tx_full_ = (message_buffer == nullptr);
+      if (message_buffer == nullptr)
+      {
+        ESP_LOGW(TAG, "BLE TX: Write queue full (%d messages waiting)", ble_tx_ring_.size());
+      }
+      return message_buffer;
+    }
+
+    int TeslaBLEVehicle::writeBLE(
+        const unsigned char *message_buffer, size_t message_length,
+        esp_gatt_write_type_t write_type, esp_gatt_auth_req_t auth_req,
+        BLETXPriority priority)
+    {
+      ESP_LOGD(TAG, "BLE TX: %s", format_hex(message_buffer, message_length).c_str());
+      if (!ble_tx_ring_.contains(message_buffer))
+      { // Message wasn't built in the ring (see reserveBLE) so copy it in
+        unsigned char *ring_buffer = ble_tx_ring_.reserve(message_length);
+        ble_tx_full_ = (ring_buffer == nullptr);
+        if (ring_buffer == nullptr)
+        {
+          ESP_LOGW(TAG, "BLE TX: Write queue full (%d messages waiting)", ble_tx_ring_.size());
+          return 1;
+        }
+        memcpy(ring_buffer, message_buffer, message_length);
+        message_buffer = ring_buffer;
+      }
+      ble_tx_has_uuid_ = find_message_uuid(message_buffer, message_length, ble_tx_uuid_);
+      // Chunks are cut from the ring as they are sent, sized to the negotiated MTU (see setChunkSizeFromMTU)
+      if (!ble_tx_ring_.commit(message_buffer, message_length, write_type, auth_req, priority))
+      {
+        ESP_LOGE(TAG, "BLE TX: Failed to add message to write queue");
+        return 1;
+      }
+      ESP_LOGD(TAG, "BLE TX: Added to write queue.");
+      return 0;
+    }
+
+    int TeslaBLEVehicle::sendVCSECActionMessage(VCSEC_RKEAction_E action)
+    {
+      ESP_LOGD(TAG, "Building sendVCSECActionMessage");
+      size_t action_message_buffer_length = 0;
+      unsigned char *message_buffer = reserveBLE();
+      if (message_buffer == nullptr)
+      {
+        return 1;
+      }
+      int return_code = tesla_ble_client_->buildVCSECActionMessage(action, message_buffer, &action_message_buffer_length);
+      if (return_code != 0)
+      {
+        if (return_code == TeslaBLE::TeslaBLE_Status_E_ERROR_INVALID_SESSION)
+        {
+          auto session = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+          invalidateSession(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+        }
+        ESP_LOGE(TAG, "Failed to build action message");
+        return return_code;
+      }
+
+      // A wake is part of recovering a command so mustn't wait behind other traffic
+      BLETXPriority priority = (action == VCSEC_RKEAction_E_RKE_ACTION_WAKE_VEHICLE) ? BLETXPriority::CONTROL : BLETXPriority::NORMAL;
+      return_code = writeBLE(message_buffer, action_message_buffer_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE, priority);
+      if (return_code != 0)
+      {
+        ESP_LOGE(TAG, "Failed to send action message");
+        return return_code;
+      }
+      return 0;
+    }
+
+    BLECommandHandle TeslaBLEVehicle::sendVCSECClosureMoveRequestMessage (int moveWhat, VCSEC_ClosureMoveType_E moveType)
+    /*
+    *   Queues the move so it is authenticated, retried and reported like the other commands. What to move and how are packed
+    *   into the command's param for executeClosureMove.
+    */
+    {
+      switch (moveWhat)
+      {
+        case VCSEC_ClosureMoveRequest_rearTrunk_tag:
+        case VCSEC_ClosureMoveRequest_frontTrunk_tag:
+        case VCSEC_ClosureMoveRequest_chargePort_tag:
+        case VCSEC_ClosureMoveRequest_frontDriverDoor_tag:
           break;
-        }
         default:
-        {
-          ESP_LOGD(TAG, "Received message for %s", domain_to_string(read_queue_message_.to_destination.sub_destination.domain));
-          ESP_LOGD(TAG, "Received message from unknown domain %s", domain_to_string(read_queue_message_.from_destination.sub_destination.domain));
+          ESP_LOGE (TAG, "Unhandled moveWhat requested %d", moveWhat);
+          return 0;
+      }
+      ESP_LOGI(TAG, "Adding closure move command to queue (move %d type %d)", moveWhat, moveType);
+      BLECommand command (UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY, BLECommandKind::CLOSURE_MOVE,
+                          BLE_CarServer_VehicleAction::DO_NOTHING, (moveWhat << 8) | static_cast<int32_t>(moveType));
+      BLECommandHandle handle = assignHandle (command);
+      placeAtFrontOfQueue (command);
+      return handle;
+    }
+
+    int TeslaBLEVehicle::executeClosureMove (int moveWhat, VCSEC_ClosureMoveType_E moveType)
+    {
+      ESP_LOGD(TAG, "Building sendVCSECClosureMoveRequestMessage");
+      size_t action_message_buffer_length = 0;
+      VCSEC_ClosureMoveRequest closureMoveRequest = VCSEC_ClosureMoveRequest_init_default; // initialise to do nothing on all
+      switch (moveWhat)
+      { // For the requested item, change the do nothing to do something
+        case VCSEC_ClosureMoveRequest_rearTrunk_tag:
+          closureMoveRequest.rearTrunk = moveType;
           break;
-        }
-        break;
-        }
-        break;
+        case VCSEC_ClosureMoveRequest_frontTrunk_tag:
+          closureMoveRequest.frontTrunk = moveType;
+          break;
+        case VCSEC_ClosureMoveRequest_chargePort_tag:
+          closureMoveRequest.chargePort = moveType;
+          break;
+        case VCSEC_ClosureMoveRequest_frontDriverDoor_tag:
+          closureMoveRequest.frontDriverDoor = moveType;
+          break;
+        default:
+          ESP_LOGE (TAG, "Unhandled moveWhat requested %d", moveWhat);
+          return 1;
       }
 
-      case UniversalMessage_Destination_routing_address_tag:
+      unsigned char *message_buffer = reserveBLE();
+      if (message_buffer == nullptr)
       {
-        ESP_LOGD(TAG, "Received message from routing address");
-        break;
+        return 1;
       }
-      default:
+      int return_code = tesla_ble_client_->buildVCSECClosureMoveRequestMessage (closureMoveRequest, message_buffer, &action_message_buffer_length);
+      if (return_code != 0)
       {
-        ESP_LOGD(TAG, "Received message from unknown domain %s", domain_to_string(read_queue_message_.from_destination.sub_destination.domain));
-        break;
+        if (return_code == TeslaBLE::TeslaBLE_Status_E_ERROR_INVALID_SESSION)
+        {
+          auto session = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+          invalidateSession (UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
+        }
+        ESP_LOGE (TAG, "Failed to build ClosureMoveRequest message");
+        return return_code;
       }
-      break;
+
+      return_code = writeBLE(message_buffer, action_message_buffer_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
+      if (return_code != 0)
+      {
+        ESP_LOGE (TAG, "Failed to send ClosureMoveRequest message");
+        return return_code;
       }
+      return 0;
     }
 
-    void TeslaBLEVehicle::loop()
+    BLECommandHandle TeslaBLEVehicle::assignHandle (BLECommand &command)
+    { // Handles count up from 1, 0 is kept for "nothing queued"
+      command.handle = next_command_handle_++;
+      if (next_command_handle_ == 0)
+      {
+        next_command_handle_ = 1;
+      }
+      return command.handle;
+    }
+
+    void TeslaBLEVehicle::reportCommand (BLECommand &command, BLECommandOutcome outcome)
+    /*
+    *   Tells the on_command_* automations how a command asked for through a public entry point went, once only. The queue wait
+    *   runs until the command was first worked on and the latency from then until now. Commands given up on before they
+    *   started have no latency.
+    */
     {
-      if (this->node_state != espbt::ClientState::ESTABLISHED)
+      if (command.handle == 0)
       {
-        if (!command_queue_.empty())
-        {
-          // clear command queue if not connected or on first boot (prevent restore value triggering commands)
-          command_queue_.pop();
-        }
         return;
       }
-      process_ble_read_queue();
-      process_response_queue();
-      process_command_queue();
-      process_ble_write_queue();
+      BLECommandHandle handle = command.handle;
+      command.handle = 0;
+      uint32_t now = millis();
+      bool started = (command.state != BLECommandState::IDLE);
+      uint32_t queue_wait = (started ? command.started_at : now) - command.queued_at;
+      uint32_t latency = started ? now - command.started_at : 0;
+      std::string action = command.name();
+      switch (outcome)
+      {
+        case BLECommandOutcome::SUCCESS:
+          ESP_LOGD(TAG, "[%s] Command %u succeeded (queued %u ms, took %u ms)", action.c_str(), handle, queue_wait, latency);
+          command_success_callback_.call(handle, action, queue_wait, latency);
+          break;
+        case BLECommandOutcome::FAILURE:
+          ESP_LOGD(TAG, "[%s] Command %u failed (queued %u ms, took %u ms)", action.c_str(), handle, queue_wait, latency);
+          command_failure_callback_.call(handle, action, queue_wait, latency);
+          break;
+        case BLECommandOutcome::TIMEOUT:
+          ESP_LOGD(TAG, "[%s] Command %u timed out (queued %u ms, took %u ms)", action.c_str(), handle, queue_wait, latency);
+          command_timeout_callback_.call(handle, action, queue_wait, latency);
+          break;
+      }
     }
 
-    void TeslaBLEVehicle::update()
+    void TeslaBLEVehicle::finishCommand (size_t index, BLECommandOutcome outcome)
+    /*
+    *   Takes a command out of the queue for good. It is reported after it has gone, so an automation that queues another
+    *   command in response finds the queue as it now is.
+    */
     {
-      ESP_LOGD(TAG, "Updating Tesla BLE Vehicle component, command queue size is %d ..", command_queue_.size());
-      /*
-      *   When the car departs, the node_state is no longer established so the main loop isn't entered and any timeouts in there
-      *   are no longer available. Therefore have to handle disconnections outside of the main loop.
-      */
-      if (ble_disconnected_min_time_ != 0)
-      { // Only delay setting to Unknown if not zero
-        if ((ble_disconnected_ == BleDisconnected) and ((millis() - ble_disconnected_time_) > ble_disconnected_min_time_))
-        { // Only make sensors Unknown if ble disconnected continuously for the configured time
-          this->setSensors(false);
-          ble_disconnected_ = BleDisconnectedUnknownsSet;
-        }
+      if (index >= command_queue_.size())
+      {
+        return;
       }
+      BLECommand finished = command_queue_.at(index);
+      command_queue_.erase(index);
+      reportCommand(finished, outcome);
+    }
 
-if (ble_disconnected_ != BleConnected) // While disconnected update duration of disconnection
-{
-  publishSensor (NumericSensorId::BleDisconnectedTime, (millis() - ble_disconnected_time_) / 1000);
-}
+    void TeslaBLEVehicle::dropCommand (size_t index, BLECommandOutcome outcome)
+    { // Finishes a command that was given up on without an answer either way, counting it
+      commands_dropped_++;
+      publishSensor (NumericSensorId::BleCommandsDropped, commands_dropped_);
+      finishCommand(index, outcome);
+    }
 
-      if (this->node_state == espbt::ClientState::ESTABLISHED)
+    void TeslaBLEVehicle::expireCommands ()
+    /*
+    *   Drops every command past the deadline its policy gives it, started or not. A poll that has waited that long would be
+    *   asked for again by the next one anyway, so airtime only goes on work that still matters.
+    */
+    {
+      uint32_t now = millis();
+      for (size_t i = 0; i < command_queue_.size();)
       {
-        ESP_LOGD(TAG, "Querying vehicle status update..");
-        enqueueVCSECInformationRequest();
-        /*
-        *	INFOTAINMENT data can only be collected when the car is awake, while VCSEC data also when the car is asleep.
-        *	Therefore we trigger polling for INFOTAINMENT data under the following circumstances:
-        *	- on startup. This might wake the car but we want the entities to have initial values.
-        *	- whenever the car wakes up. However, depending on the wake:
-        *	  - if the car woke up of its own accord, poll for post_wake_poll_time s every poll_data_period s and allow the car to
-        *     go back to sleep.
-        *	  - if the car was woken by someone getting in the car (door unlocked or user present), or the car is charging,
-        *     then poll continuously at update_interval to have the data as up to date as possible (eg shift state which some people
-        *		  want to use to trigger the opening of their electric gate) until the trigger state ends.
-        *   - Otherwise we poll the Infotainment system every poll_asleep_period s in case the car was charging, charging then stops
-        *     but resumes while the car has been awake continuously (otherwise we would never notice it's charging again). This period
-        *     should be chosen to be long enough so that the car will fall asleep if nothing else is happening to keep it awake.
-        */
-        switch (esp32_just_started_)
-        {
-        case 2:
-          // If the ESP32 has just started and wake on boot wanted, wake car even if already awake to get an initial poll of its data
-          if (wake_on_boot_ > 0)
-          {
-            wakeVehicle(); // wake will cause poll assuming car available
-          }
-          esp32_just_started_++;
-          ESP_LOGI (TAG, "Polling parameters: post_wake_poll_time_ %i, poll_data_period_  %i, poll_asleep_period_ %i, poll_charging_period_  %i, ble_disconnected_min_time_  %i, fast_poll_if_unlocked_ %i, wake_on_boot_ %i",
-            post_wake_poll_time_,
-            poll_data_period_,
-            poll_asleep_period_,
-            poll_charging_period_,
-            ble_disconnected_min_time_,
-            fast_poll_if_unlocked_,
-            wake_on_boot_);
-          break;
-        case 0:
-        case 1:
-          esp32_just_started_++;
-        // Beyond 2 this is no longer relevant
-        }
-        if (!binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state and previous_asleep_state_) // Remember, true means asleep
+        BLECommand &command = command_queue_.at(i);
+        if (not command.expired(now))
         {
-          // Car has just woken, also record time it happened so can time out after configured time
-          car_just_woken_ = 1;
-          car_wake_time_ = millis();
-        }
-        if (binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state and !previous_asleep_state_) // Car has just gone to sleep
-        { // Belt & braces clear poll triggers if car is asleep
-          car_is_charging_ = NotCharging;
+          i++;
+          continue;
         }
-        previous_asleep_state_ = binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state;
+        ESP_LOGW(TAG, "[%s] Dropped as out of date, queued %d ms ago with %d commands in the queue", command.name(),
+                 static_cast<int>(now - command.queued_at), command_queue_.size());
+        dropCommand(i, BLECommandOutcome::TIMEOUT);
+      }
+    }
 
-        ESP_LOGI (TAG, "Reading INFOTAINMENT, previous_asleep_state_=%d, car_just_woken_=%d, car_is_charging_=%d, Unlocked=%d, User=%d, fast_poll_if_unlocked_=%d",
-                  previous_asleep_state_, car_just_woken_, car_is_charging_, binary_sensors_[static_cast<size_t>(BinarySensorId::IsUnlocked)]->state, binary_sensors_[static_cast<size_t>(BinarySensorId::IsUserPresent)]->state, fast_poll_if_unlocked_);
-        
-        //if (car_just_woken_ or OneOffUpdate or car_is_charging_ or this->is_unlocked_->state or this->is_user_present_->state)
-        if (one_off_update_ or (binary_sensors_[static_cast<size_t>(BinarySensorId::IsUnlocked)]->state and (fast_poll_if_unlocked_ > 0)) or binary_sensors_[static_cast<size_t>(BinarySensorId::IsUserPresent)]->state)
-        { // For these fastest poll rate is used
-          do_poll_ = true;
-        }
-        else if (car_is_charging_ != NotCharging)
-        { // otherwise charging polls have priority
-          if (car_is_charging_ == ChargingJustStarted)
-          { // Do a poll as soon as notice car is charging
-            do_poll_ = true;
-            car_is_charging_ = ChargingOngoing;
-          }
-          else if (((millis() - last_infotainment_poll_time_) > poll_charging_period_))
-          { // subsequent polls on the configured repeat period
-            do_poll_ = true;
-          }
-        }
-        else if (car_just_woken_ != 0)
-        { // Just woken polls lower priority
-          if (car_just_woken_ == 1)
-          { // Do a poll as soon as the car awakes
-            do_poll_ = true;
-            car_just_woken_ = 2;
-          }
-          else if ((millis() - last_infotainment_poll_time_) > poll_data_period_)
-          { // subsequent polls on the configured repeat period
-            do_poll_ = true;
-          }
-        }
-        else if (poll_asleep_period_ != 0)
-        { // Try slower polls even when car is asleep unless set to 0
-          if ((millis() - last_infotainment_poll_time_) > poll_asleep_period_)
-          {
-            do_poll_ = true;
-          }
-        }
-        if (do_poll_)
-        {
-          // Start retrieval of data from car. Each data type has its own frequency.
-          last_infotainment_poll_time_ = millis();
-          if ((number_updates_since_connection_ % get_action_detail(BLE_CarServer_VehicleAction::GET_CHARGE_STATE).numberUpdatesBetweenGets) == 0)
-              sendCarServerVehicleActionMessage (BLE_CarServer_VehicleAction::GET_CHARGE_STATE, 0);
-          if ((number_updates_since_connection_ % get_action_detail(BLE_CarServer_VehicleAction::GET_DRIVE_STATE).numberUpdatesBetweenGets) == 0)
-            sendCarServerVehicleActionMessage (BLE_CarServer_VehicleAction::GET_DRIVE_STATE, 0);
-          if ((number_updates_since_connection_ % get_action_detail(BLE_CarServer_VehicleAction::GET_CLIMATE_STATE).numberUpdatesBetweenGets) == 0)
-            sendCarServerVehicleActionMessage (BLE_CarServer_VehicleAction::GET_CLIMATE_STATE, 0);
-          if ((number_updates_since_connection_ % get_action_detail(BLE_CarServer_VehicleAction::GET_CLOSURES_STATE).numberUpdatesBetweenGets) == 0)
-            sendCarServerVehicleActionMessage (BLE_CarServer_VehicleAction::GET_CLOSURES_STATE, 0);
-          if ((number_updates_since_connection_ % get_action_detail(BLE_CarServer_VehicleAction::GET_TYRES_STATE).numberUpdatesBetweenGets) == 0)
-            sendCarServerVehicleActionMessage (BLE_CarServer_VehicleAction::GET_TYRES_STATE, 0);
-          if ((car_just_woken_ != 0) and ((millis() - car_wake_time_) > post_wake_poll_time_))
-          {
-            car_just_woken_ = 0;
-          }
-          one_off_update_ = false; // Clear once a single cycle of data collection completed
-          do_poll_ = false;
-          number_updates_since_connection_++;
-        }
+    void TeslaBLEVehicle::placeAtFrontOfQueue (const BLECommand &command)
+    /*
+    *   Puts the command at the front of its lane. If the command at the head of the lane is in progress, it needs to stay there
+    *   so it can finish and the new command goes just behind it, unless it's a background read a user action can go ahead of.
+    *   A full queue makes room by dropping the newest waiting command.
+    */
+    {
+      if (command_queue_.full())
+      {
+        ESP_LOGW(TAG, "[%s] Command queue full, dropping %s", command.name(), command_queue_.back().name());
+        dropCommand(command_queue_.size() - 1, BLECommandOutcome::FAILURE);
+      }
+      int head = command_queue_.head(command.lane());
+      if ((head >= 0) and (command_queue_.at(head).state != BLECommandState::IDLE) and
+          command_queue_.at(head).preemptible() and not command.preemptible())
+      {
+        suspendCommand(head);
+        head = command_queue_.head(command.lane());
+      }
+      if ((head < 0) or (command_queue_.at(head).state == BLECommandState::IDLE))
+      {
+        command_queue_.push_front (command);
         return;
       }
+      command_queue_.insert (head + 1, command);
     }
 
-    int TeslaBLEVehicle::nvs_save_session_info(const Signatures_SessionInfo &session_info, const UniversalMessage_Domain domain)
+    void TeslaBLEVehicle::placeProbe (const BLECommand &command)
+    /*
+    *   While the breaker is open the status poll is all that is worked on, so it goes to the very front of its lane, ahead of
+    *   any command held part way through. One already waiting is replaced rather than doubled.
+    */
     {
-      ESP_LOGD(TAG, "Storing updated session info in NVS for domain %s", domain_to_string(domain));
-      const char *nvs_key = (domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) ? nvs_key_infotainment : nvs_key_vcsec;
-
-      // Estimate required buffer size
-      size_t session_info_encode_buffer_size = Signatures_SessionInfo_size + 10; // Add some padding
-      std::vector<pb_byte_t> session_info_encode_buffer(session_info_encode_buffer_size);
-
-      // Encode session info into protobuf message
-      int return_code = TeslaBLE::pb_encode_fields(session_info_encode_buffer.data(), &session_info_encode_buffer_size, Signatures_SessionInfo_fields, &session_info);
-      if (return_code != 0)
+      int head = command_queue_.head(command.lane());
+      if ((head >= 0) and command_queue_.at(head).probe())
       {
-        ESP_LOGE(TAG, "Failed to encode session info for domain %s. Error code: %d", domain_to_string(domain), return_code);
-        return return_code;
+        ESP_LOGD(TAG, "[%s] Already queued", command.name());
+        return;
       }
-      ESP_LOGD(TAG, "Session info encoded to %d bytes for domain %s", session_info_encode_buffer_size, domain_to_string(domain));
-      ESP_LOGD(TAG, "Session info: %s", format_hex(session_info_encode_buffer.data(), session_info_encode_buffer_size).c_str());
+      for (size_t i = 0; i < command_queue_.size(); i++)
+      {
+        if (command_queue_.at(i).probe())
+        {
+          command_queue_.erase(i);
+          break;
+        }
+      }
+      if (command_queue_.full())
+      {
+        ESP_LOGW(TAG, "[%s] Command queue full, dropping %s", command.name(), command_queue_.back().name());
+        dropCommand(command_queue_.size() - 1, BLECommandOutcome::FAILURE);
+      }
+      command_queue_.push_front (command);
+    }
 
-      // Store encoded session info in NVS
-      esp_err_t err = nvs_set_blob(this->storage_handle_, nvs_key, session_info_encode_buffer.data(), session_info_encode_buffer_size);
-      if (err != ESP_OK)
+    void TeslaBLEVehicle::suspendCommand (size_t index)
+    /*
+    *   Puts a started read back to waiting so a user action can go first. Only whole messages are ever written, so one already
+    *   sent still goes and its response is still used, though nothing waits for it. The read starts again from the top once
+    *   its turn comes, or is dropped if the same read is already waiting to be sent.
+    */
+    {
+      BLECommand &command = command_queue_.at(index);
+      command.state = BLECommandState::IDLE; // Keeps find_waiting off it
+      BLECommand *waiting = command_queue_.find_waiting(command.kind, command.action);
+      if ((waiting != nullptr) and (waiting != &command) and (command.handle == 0))
       {
-        ESP_LOGE(TAG, "Failed to set %s key in storage: %s", domain_to_string(domain), esp_err_to_name(err));
-        return static_cast<int>(err);
+        ESP_LOGI(TAG, "[%s] Dropped for a user command, the same read is already queued", command.name());
+        if (command.action == BLE_CarServer_VehicleAction::GET_VEHICLE_DATA)
+        {
+          waiting->param |= command.param;
+        }
+        finishCommand(index, BLECommandOutcome::FAILURE);
+        return;
       }
+      ESP_LOGI(TAG, "[%s] Suspended for a user command", command.name());
+      command.retry_count = 0;
+      command.sends = 0;
+      command.done_times = 0;
+      command.has_request_uuid = false;
+      command.written = false;
+      command.send_failed = false;
+    }
 
-      // Commit the changes to NVS
-      err = nvs_commit(this->storage_handle_);
-      if (err != ESP_OK)
+    bool BLECommandQueue::push (const BLECommand &command)
+    {
+      if (full())
       {
-        ESP_LOGE(TAG, "Failed to commit storage for domain %s: %s", domain_to_string(domain), esp_err_to_name(err));
-        return static_cast<int>(err);
+        return false;
       }
-
-      ESP_LOGD(TAG, "Successfully saved session info for domain %s", domain_to_string(domain));
-      return 0;
+      commands_[(head_ + count_) % commands_.size()] = command;
+      count_++;
+      return true;
     }
 
-    int TeslaBLEVehicle::nvs_load_session_info(Signatures_SessionInfo *session_info, const UniversalMessage_Domain domain)
+    bool BLECommandQueue::push_front (const BLECommand &command)
     {
-      if (session_info == nullptr)
+      if (full())
       {
-        ESP_LOGE(TAG, "Invalid session_info pointer");
-        return 1;
+        return false;
       }
+      head_ = (head_ + commands_.size() - 1) % commands_.size();
+      commands_[head_] = command;
+      count_++;
+      return true;
+    }
 
-      const std::string nvs_key = (domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) ? nvs_key_infotainment : nvs_key_vcsec;
-
-      size_t required_session_info_size = 0;
-      esp_err_t err = nvs_get_blob(this->storage_handle_, nvs_key.c_str(), nullptr, &required_session_info_size);
-      if (err != ESP_OK)
+    bool BLECommandQueue::insert (size_t index, const BLECommand &command)
+    { // Opens a gap by moving whichever side of it holds fewer commands out by one, as for erase
+      if (full() or (index > count_))
       {
-        ESP_LOGE(TAG, "Failed to read %s key size from storage: %s", domain_to_string(domain), esp_err_to_name(err));
-        return 1;
+        return false;
       }
-
-      std::vector<uint8_t> session_info_protobuf(required_session_info_size);
-      err = nvs_get_blob(this->storage_handle_, nvs_key.c_str(), session_info_protobuf.data(), &required_session_info_size);
-      if (err != ESP_OK)
+      if (index == 0)
       {
-        ESP_LOGE(TAG, "Failed to read %s key data from storage: %s", domain_to_string(domain), esp_err_to_name(err));
-        return 1;
+        return push_front (command);
       }
+      if (index < count_ - index)
+      { // Move those ahead of it forward
+        head_ = (head_ + commands_.size() - 1) % commands_.size();
+        count_++;
+        for (size_t i = 0; i < index; i++)
+        {
+          at(i) = at(i + 1);
+        }
+      }
+      else
+      { // Move those behind it back
+        count_++;
+        for (size_t i = count_ - 1; i > index; i--)
+        {
+          at(i) = at(i - 1);
+        }
+      }
+      at(index) = command;
+      return true;
+    }
 
-      ESP_LOGI(TAG, "Loaded %s session info from NVS", domain_to_string(domain));
-      ESP_LOGD(TAG, "Session info: %s", format_hex(session_info_protobuf.data(), required_session_info_size).c_str());
-
-      pb_istream_t stream = pb_istream_from_buffer(session_info_protobuf.data(), required_session_info_size);
-      if (!pb_decode(&stream, Signatures_SessionInfo_fields, session_info))
+    int BLECommandQueue::head (UniversalMessage_Domain lane)
+    { // Index of the oldest command in the lane, or -1 if it has none
+      for (size_t i = 0; i < count_; i++)
       {
-        ESP_LOGE(TAG, "Failed to decode session info response: %s", PB_GET_ERROR(&stream));
-        return 1;
+        if (at(i).lane() == lane)
+        {
+          return static_cast<int>(i);
+        }
       }
-
-      log_session_info(TAG, session_info);
-
-      auto session = tesla_ble_client_->getPeer(domain);
-      session->updateSession(session_info);
-
-      return 0;
+      return -1;
     }
 
-    int TeslaBLEVehicle::nvs_initialize_private_key()
+    void BLECommandQueue::pop ()
     {
-      size_t required_private_key_size = 0;
-      int err = nvs_get_blob(this->storage_handle_, "private_key", NULL, &required_private_key_size);
-      ESP_LOGD (TAG, "Required_private_key_size = %d", static_cast<int>(required_private_key_size));
-      if (err != ESP_OK)
+      if (count_ == 0)
       {
-        ESP_LOGW(TAG, "Failed read private key from storage: %s", esp_err_to_name(err));
+        return;
       }
+      head_ = (head_ + 1) % commands_.size();
+      count_--;
+    }
 
-      if (required_private_key_size == 0)
+    void BLECommandQueue::pop_back ()
+    {
+      if (count_ != 0)
       {
-        int result_code = tesla_ble_client_->createPrivateKey();
-        if (result_code != 0)
-        {
-          ESP_LOGE(TAG, "Failed create private key");
-          return result_code;
-        }
-
-        unsigned char private_key_buffer[PRIVATE_KEY_SIZE];
-        size_t private_key_length = 0;
-        tesla_ble_client_->getPrivateKey(private_key_buffer, sizeof(private_key_buffer), &private_key_length);
-
-        esp_err_t err = nvs_set_blob(this->storage_handle_, "private_key", private_key_buffer, private_key_length);
+        count_--;
+      }
+    }
 
-        err = nvs_commit(this->storage_handle_);
-        if (err != ESP_OK)
+    void BLECommandQueue::erase (size_t index)
+    { // Closes the gap by moving whichever side of it holds fewer commands in by one, the order is kept either way
+      if (index >= count_)
+      {
+        return;
+      }
+      if (index < count_ - 1 - index)
+      {
+        for (size_t i = index; i > 0; i--)
         {
-          ESP_LOGE(TAG, "Failed commit storage: %s", esp_err_to_name(err));
+          at(i) = at(i - 1);
         }
-
-        ESP_LOGI(TAG, "Private key successfully created");
+        pop();
       }
       else
       {
-        unsigned char private_key_buffer[required_private_key_size];
-        err = nvs_get_blob(this->storage_handle_, "private_key", private_key_buffer, &required_private_key_size);
-        if (err != ESP_OK)
+        for (size_t i = index; i + 1 < count_; i++)
         {
-          ESP_LOGE(TAG, "Failed read private key from storage: %s", esp_err_to_name(err));
-          return 1;
+          at(i) = at(i + 1);
         }
+        pop_back();
+      }
+    }
 
-        int result_code = tesla_ble_client_->loadPrivateKey(private_key_buffer, required_private_key_size);
-        if (result_code != 0)
+    int BLECommandQueue::find_request (const uint8_t *request_uuid, size_t uuid_length, UniversalMessage_Domain domain)
+    /*
+    *   Index of the command in progress that a response from the domain is for, or -1. A response carrying a UUID belongs to
+    *   the command whose message had it. Without one, or when commands didn't record one, it's taken to be for the oldest.
+    *   A UUID matching nothing is from an attempt that has since been superseded.
+    */
+    {
+      int oldest = -1;
+      for (size_t i = 0; i < count_; i++)
+      {
+        BLECommand &command = at(i);
+        if ((command.domain != domain) or (command.state == BLECommandState::IDLE))
         {
-          ESP_LOGE(TAG, "Failed load private key");
-          return result_code;
+          continue;
+        }
+        if ((uuid_length == sizeof(command.request_uuid)) and command.has_request_uuid and
+            (memcmp(command.request_uuid, request_uuid, uuid_length) == 0))
+        {
+          return static_cast<int>(i);
+        }
+        if (oldest < 0)
+        {
+          oldest = static_cast<int>(i);
         }
+      }
+      if ((oldest >= 0) and (uuid_length != 0) and at(oldest).has_request_uuid)
+      {
+        return -1;
+      }
+      return oldest;
+    }
 
-        ESP_LOGI(TAG, "Private key loaded successfully");
+    BLECommand *BLECommandQueue::find_waiting (BLECommandKind kind, BLE_CarServer_VehicleAction action)
+    { // The queued command of the same kind and action that hasn't been sent yet, if there is one. Ready ones count too, as
+      // under the rate limit pipelined commands can sit ready for a while. The earliest is kept, with its place and handle
+      for (size_t i = 0; i < count_; i++)
+      {
+        BLECommand &command = at(i);
+        bool unsent = (command.state == BLECommandState::IDLE) or ((command.state == BLECommandState::READY) and (command.sends == 0));
+        if (unsent and (command.kind == kind) and (command.action == action))
+        {
+          return &command;
+        }
       }
-      return 0;
+      return nullptr;
     }
 
-    void TeslaBLEVehicle::set_vin(const char *vin)
+    int TeslaBLEVehicle::executeCommand (const BLECommand &command)
+    /*
+    *   Sends the message for a command. Called each time the command is (re)tried.
+    */
     {
-      tesla_ble_client_->setVIN(vin);
+      int return_code = 0;
+      ble_tx_full_ = false; // Only set again if this message finds the TX ring full
+      switch (command.kind)
+      {
+        case BLECommandKind::LOCK:
+          return_code = this->sendVCSECActionMessage(VCSEC_RKEAction_E_RKE_ACTION_LOCK);
+          break;
+        case BLECommandKind::UNLOCK:
+          return_code = this->sendVCSECActionMessage(VCSEC_RKEAction_E_RKE_ACTION_UNLOCK);
+          break;
+        case BLECommandKind::DATA_UPDATE:
+        case BLECommandKind::DATA_UPDATE_FORCED:
+          return_code = this->sendVCSECInformationRequest();
+          break;
+        case BLECommandKind::CLOSURE_MOVE:
+          return_code = this->executeClosureMove(command.param >> 8, static_cast<VCSEC_ClosureMoveType_E>(command.param & 0xFF));
+          break;
+        case BLECommandKind::CARSERVER_ACTION:
+          return_code = this->executeCarServerAction(command.action, command.param);
+          break;
+        default:
+          ESP_LOGE(TAG, "Invalid command kind: %d", static_cast<int>(command.kind));
+          return 1;
+      }
+      if (return_code != 0)
+      {
+        ESP_LOGE(TAG, "[%s] Failed to send command", command.name());
+      }
+      return return_code;
     }
 
-    void TeslaBLEVehicle::load_polling_parameters (const int post_wake_poll_time, const int poll_data_period,
-                                                   const int poll_asleep_period, const int poll_charging_period,
-                                                   const int ble_disconnected_min_time, const int fast_poll_if_unlocked,
-                                                   const int wake_on_boot)
-    {
-      // All timings are in milliseconds
-      post_wake_poll_time_ = post_wake_poll_time * 1000;
-      poll_data_period_ = poll_data_period * 1000;
-      poll_asleep_period_ = poll_asleep_period * 1000;
-      poll_charging_period_ = poll_charging_period * 1000;
-      ble_disconnected_min_time_ = ble_disconnected_min_time * 1000;
-      fast_poll_if_unlocked_ = fast_poll_if_unlocked;
-      wake_on_boot_ = wake_on_boot;
+    void TeslaBLEVehicle::commandSent (BLECommand &command, uint32_t now)
+    { // Moves a command on once its message is queued, noting the UUID its response will carry
+      if (command.sends != 0)
+      { // Sending again, so allow longer for the response this time
+        backOffResponseTimeout(command.sends_to());
+      }
+      bucket(command.sends_to()).take();
+      command.sends++;
+      command.last_tx_at = now;
+      command.retry_delay = retryDelay(command.sends_to());
+      command.state = command.detail().sentState;
+      command.done_times = 0;
+      command.send_failed = false;
+      noteRequestUUID(command);
     }
 
-    void TeslaBLEVehicle::regenerateKey()
+    void TeslaBLEVehicle::commandSendFailed (BLECommand &command, uint32_t now)
+    /*
+    *   A command's message couldn't be queued. A full TX ring soon drains, so then it is simply tried again next loop. Anything
+    *   else, like a session the library rejects, would most likely fail the same way straight away, so it uses up an attempt
+    *   and waits retry_delay before the next one.
+    */
     {
-      ESP_LOGI(TAG, "Regenerating key");
-      int result_code = tesla_ble_client_->createPrivateKey();
-      if (result_code != 0)
+      if (ble_tx_full_)
       {
-        ESP_LOGE(TAG, "Failed create private key");
         return;
       }
+      command.retry_count++;
+      command.send_failed = true;
+      command.last_tx_at = now;
+      command.retry_delay = retryDelay(command.sends_to());
+    }
 
-      unsigned char private_key_buffer[PRIVATE_KEY_SIZE];
-      size_t private_key_length = 0;
-      tesla_ble_client_->getPrivateKey(private_key_buffer, sizeof(private_key_buffer), &private_key_length);
+    void TeslaBLEVehicle::noteRequestUUID (BLECommand &command)
+    { // Remembers the UUID of the message just written, so its response and its TX completion can be tied to the command
+      command.has_request_uuid = ble_tx_has_uuid_;
+      memcpy(command.request_uuid, ble_tx_uuid_, sizeof(command.request_uuid));
+      command.written = false;
+    }
 
-      esp_err_t err = nvs_flash_init();
-      if (err != ESP_OK)
+    void TeslaBLEVehicle::messageSent (const unsigned char *message, size_t length)
+    /*
+    *   The last chunk of a message has gone. Waits for its response are timed from now rather than from when it was queued,
+    *   so a backed up TX ring doesn't make them time out early.
+    */
+    {
+      uint8_t uuid[16];
+      if (not find_message_uuid(message, length, uuid))
       {
-        ESP_LOGE(TAG, "Failed to initialize flash: %s", esp_err_to_name(err));
+        return;
       }
-
-      err = nvs_open("storage", NVS_READWRITE, &this->storage_handle_);
-      if (err != ESP_OK)
+      uint32_t now = millis();
+      if (wake_.has_request_uuid and (memcmp(wake_.request_uuid, uuid, sizeof(uuid)) == 0))
       {
-        ESP_LOGE(TAG, "Failed to open NVS handle: %s", esp_err_to_name(err));
+        wake_.last_tx_at = now;
+        wake_.written = true;
+        return;
       }
-
-      err = nvs_set_blob(this->storage_handle_, "private_key", private_key_buffer, private_key_length);
-      if (err != ESP_OK)
+      for (size_t i = 0; i < command_queue_.size(); i++)
       {
-        ESP_LOGE(TAG, "Failed commit storage: %s", esp_err_to_name(err));
+        BLECommand &command = command_queue_.at(i);
+        if (command.has_request_uuid and (memcmp(command.request_uuid, uuid, sizeof(uuid)) == 0))
+        {
+          command.last_tx_at = now;
+          command.written = true;
+          return;
+        }
       }
+    }
 
-      err = nvs_commit(this->storage_handle_);
-      if (err != ESP_OK)
+    BLERTTEstimator &TeslaBLEVehicle::rtt (UniversalMessage_Domain domain)
+    {
+      return (domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) ? infotainment_rtt_ : vcsec_rtt_;
+    }
+
+    void TeslaBLEVehicle::commandAnswered (const BLECommand &command, UniversalMessage_Domain domain)
+    { // Measures the round trip to the domain from a command's response, unless it was sent more than once (Karn's algorithm)
+      if ((command.state == BLECommandState::WAITING_FOR_RESPONSE) and (command.sends == 1))
       {
-        ESP_LOGE(TAG, "Failed commit storage: %s", esp_err_to_name(err));
+        sampleRTT(domain, millis() - command.last_tx_at);
       }
+    }
 
-      ESP_LOGI(TAG, "Private key successfully created");
+    void TeslaBLEVehicle::sampleRTT (UniversalMessage_Domain domain, uint32_t round_trip)
+    {
+      BLERTTEstimator &estimator = rtt(domain);
+      estimator.sample(round_trip);
+      ESP_LOGD(TAG, "%s round trip %d ms, smoothed %d ms, timeout %d ms", domain_to_string(domain),
+               static_cast<int>(round_trip), static_cast<int>(estimator.srtt()), static_cast<int>(estimator.timeout()));
+      bool infotainment = (domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+      publishSensor (infotainment ? NumericSensorId::BleInfotainmentRtt : NumericSensorId::BleVcsecRtt, estimator.srtt());
+      publishSensor (infotainment ? NumericSensorId::BleInfotainmentTimeout : NumericSensorId::BleVcsecTimeout, estimator.timeout());
     }
 
-    int TeslaBLEVehicle::startPair()
+    void TeslaBLEVehicle::backOffResponseTimeout (UniversalMessage_Domain domain)
     {
-      ESP_LOGI(TAG, "Starting pairing");
-      ESP_LOGI(TAG, "Not authenticated yet, building whitelist message");
-      unsigned char whitelist_message_buffer[VCSEC_ToVCSECMessage_size];
-      size_t whitelist_message_length = 0;
-      // support for wake command will be added to ROLE_CHARGING_MANAGER in a future vehicle firmware update
-      // https://github.com/teslamotors/vehicle-command/issues/232#issuecomment-2181503570
-      // TODO: change back to ROLE_CHARGING_MANAGER when it's supported
-      int return_code = tesla_ble_client_->buildWhiteListMessage(Keys_Role_ROLE_DRIVER, VCSEC_KeyFormFactor_KEY_FORM_FACTOR_CLOUD_KEY, whitelist_message_buffer, &whitelist_message_length);
-      if (return_code != 0)
-      {
-        ESP_LOGE(TAG, "Failed to build whitelist message");
-        return return_code;
+      BLERTTEstimator &estimator = rtt(domain);
+      if (not estimator.back_off(millis()))
+      { // Already backed off for this timeout
+        return;
       }
-      ESP_LOGV(TAG, "Whitelist message length: %d", whitelist_message_length);
+      ESP_LOGD(TAG, "%s response timeout backed off to %d ms", domain_to_string(domain), static_cast<int>(estimator.timeout()));
+      publishSensor ((domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) ? NumericSensorId::BleInfotainmentTimeout : NumericSensorId::BleVcsecTimeout,
+                     estimator.timeout());
+    }
 
-      return_code = writeBLE(whitelist_message_buffer, whitelist_message_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
-      if (return_code != 0)
+    uint32_t TeslaBLEVehicle::retryDelay (UniversalMessage_Domain domain)
+    /*
+    *   How long after a request is sent it may be sent again: the response timeout, which doubles with each send that goes
+    *   unanswered, plus up to RETRY_JITTER of it at random so commands the car missed together don't all come back together.
+    */
+    {
+      uint32_t timeout = responseTimeout(domain);
+      return timeout + random_uint32() % (static_cast<uint32_t>(timeout * RETRY_JITTER) + 1);
+    }
+
+    void TeslaBLEVehicle::noteUnanswered (bool written)
+    /*
+    *   A command, or the shared wake, was given up on without the car answering it. Only counted if its last message actually
+    *   left the TX ring and then timed out, as one still stuck behind our own backlog says nothing about the car.
+    */
+    {
+      if (not written)
       {
-        ESP_LOGE(TAG, "Failed to send whitelist message");
-        return return_code;
+        ESP_LOGD(TAG, "Last attempt was never written, not counted against the car");
+        return;
+      }
+      if (breaker_.unanswered())
+      {
+        ESP_LOGW(TAG, "Car not answering, holding commands other than VCSEC status polls until it does");
+        publishBreakerState();
       }
-      ESP_LOGI(TAG, "Please tap your card on the reader now..");
-      return 0;
     }
 
-    int TeslaBLEVehicle::sendSessionInfoRequest(UniversalMessage_Domain domain)
+    void TeslaBLEVehicle::noteAnswered ()
     {
-      unsigned char message_buffer[UniversalMessage_RoutableMessage_size];
-      size_t message_length = 0;
-      int return_code = tesla_ble_client_->buildSessionInfoRequestMessage(domain, message_buffer, &message_length);
+      if (breaker_.answered())
+      {
+        ESP_LOGI(TAG, "Car answering again, resuming commands");
+        publishBreakerState();
+      }
+    }
 
-      if (return_code != 0)
+    void TeslaBLEVehicle::publishBreakerState ()
+    {
+      switch (breaker_.state())
       {
-        ESP_LOGE(TAG, "Failed to build whitelist message");
-        return return_code;
+        case BreakerState::CLOSED:
+          publishSensor (TextSensorId::BleCircuitBreaker, "Closed");
+          break;
+        case BreakerState::OPEN:
+          publishSensor (TextSensorId::BleCircuitBreaker, "Open");
+          break;
+        case BreakerState::KEY_REJECTED:
+          publishSensor (TextSensorId::BleCircuitBreaker, "Key rejected");
+          break;
       }
+    }
 
-      return_code = writeBLE(message_buffer, message_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
-      if (return_code != 0)
+    void BLERTTEstimator::sample (uint32_t rtt)
+    {
+      if (not measured_)
       {
-        ESP_LOGE(TAG, "Failed to send SessionInfoRequest");
-        return return_code;
+        srtt_ = rtt;
+        rttvar_ = rtt / 2;
+        measured_ = true;
       }
-      return 0;
+      else
+      { // RTTVAR first as it uses the old SRTT
+        uint32_t error = (srtt_ > rtt) ? (srtt_ - rtt) : (rtt - srtt_);
+        rttvar_ = (3 * rttvar_ + error) / 4;
+        srtt_ = (7 * srtt_ + rtt) / 8;
+      }
+      timeout_ = std::min(std::max(srtt_ + 4 * rttvar_, static_cast<uint32_t>(MIN_RESPONSE_TIMEOUT)), static_cast<uint32_t>(MAX_RESPONSE_TIMEOUT));
+    }
+
+    bool BLERTTEstimator::back_off (uint32_t now)
+    {
+      if (backed_off_ and ((now - backed_off_at_) <= timeout_))
+      { // Part of the same timeout event as the last back off
+        return false;
+      }
+      timeout_ = std::min(2 * timeout_, static_cast<uint32_t>(MAX_RESPONSE_TIMEOUT));
+      backed_off_ = true;
+      backed_off_at_ = now;
+      return true;
+    }
+
+    void BLERTTEstimator::reset ()
+    {
+      measured_ = false;
+      srtt_ = 0;
+      rttvar_ = 0;
+      timeout_ = MAX_LATENCY;
+      backed_off_ = false;
+    }
+
+    void BLETokenBucket::configure (float rate, uint8_t burst)
+    {
+      max_rate_ = rate;
+      rate_ = rate;
+      burst_ = burst;
+      tokens_ = burst;
+    }
+
+    void BLETokenBucket::refill (uint32_t now)
+    {
+      float elapsed = static_cast<float>(now - refilled_at_); // ms
+      refilled_at_ = now;
+      tokens_ = std::min(tokens_ + rate_ * elapsed / 1000.0f, burst_);
+      rate_ = std::min(rate_ + max_rate_ * elapsed / RATE_RECOVERY_TIME, max_rate_);
+    }
+
+    bool BLETokenBucket::available (uint32_t now)
+    { // Whether a request may go now, its token is only taken once it has been queued to send
+      refill(now);
+      return tokens_ >= 1.0f;
+    }
+
+    void BLETokenBucket::take ()
+    {
+      tokens_ = std::max(tokens_ - 1.0f, 0.0f);
     }
 
-    int TeslaBLEVehicle::writeBLE(
-        const unsigned char *message_buffer, size_t message_length,
-        esp_gatt_write_type_t write_type, esp_gatt_auth_req_t auth_req)
+    void BLETokenBucket::throttle (uint32_t now)
     {
-      ESP_LOGD(TAG, "BLE TX: %s", format_hex(message_buffer, message_length).c_str());
-      // BLE MTU is 23 bytes, so we need to split the message into chunks (20 bytes as in vehicle_command)
-      for (size_t i = 0; i < message_length; i += BLOCK_LENGTH)
-      {
-        size_t chunkLength = std::min(static_cast<size_t>(BLOCK_LENGTH), message_length - i);
-        std::vector<unsigned char> chunk(message_buffer + i, message_buffer + i + chunkLength);
+      refill(now);
+      rate_ = std::max(rate_ / 2.0f, max_rate_ * MIN_RATE_FRACTION);
+      tokens_ = 0.0f;
+    }
 
-        // add to write queue
-        this->ble_write_queue_.emplace(chunk, write_type, auth_req);
+    bool BLECircuitBreaker::unanswered ()
+    { // Returns true if this opened it
+      if (state_ != BreakerState::CLOSED)
+      {
+        return false;
       }
-      ESP_LOGD(TAG, "BLE TX: Added to write queue.");
-      return 0;
+      failures_++;
+      if (failures_ < threshold_)
+      {
+        return false;
+      }
+      state_ = BreakerState::OPEN;
+      return true;
     }
 
-    int TeslaBLEVehicle::sendVCSECActionMessage(VCSEC_RKEAction_E action)
-    {
-      ESP_LOGD(TAG, "Building sendVCSECActionMessage");
-      size_t action_message_buffer_length = 0;
-      int return_code = tesla_ble_client_->buildVCSECActionMessage(action, static_message_buffer_, &action_message_buffer_length);
-      if (return_code != 0)
+    bool BLECircuitBreaker::answered ()
+    { // Returns true if this closed it. An answer says nothing about our key, so that waits for pairing or update
+      failures_ = 0;
+      if (state_ != BreakerState::OPEN)
       {
-        if (return_code == TeslaBLE::TeslaBLE_Status_E_ERROR_INVALID_SESSION)
-        {
-          auto session = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
-          invalidateSession(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
-        }
-        ESP_LOGE(TAG, "Failed to build action message");
-        return return_code;
+        return false;
       }
+      state_ = BreakerState::CLOSED;
+      return true;
+    }
 
-      return_code = writeBLE(static_message_buffer_, action_message_buffer_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
-      if (return_code != 0)
+    bool BLECircuitBreaker::reject_key (uint32_t now)
+    { // Returns true if it wasn't already held for this
+      bool changed = (state_ != BreakerState::KEY_REJECTED);
+      state_ = BreakerState::KEY_REJECTED;
+      failures_ = 0;
+      opened_at_ = now;
+      return changed;
+    }
+
+    bool BLECircuitBreaker::update (uint32_t now)
+    { // Lets commands try again once KEY_REJECTED_HOLD has passed, in case the key was added some other way. True if it closed
+      if ((state_ != BreakerState::KEY_REJECTED) or ((now - opened_at_) <= KEY_REJECTED_HOLD))
       {
-        ESP_LOGE(TAG, "Failed to send action message");
-        return return_code;
+        return false;
       }
-      return 0;
+      close();
+      return true;
     }
 
-    int TeslaBLEVehicle::sendVCSECClosureMoveRequestMessage (int moveWhat, VCSEC_ClosureMoveType_E moveType)
+    void BLECircuitBreaker::close ()
     {
-      ESP_LOGD(TAG, "Building sendVCSECClosureMoveRequestMessage");
-      size_t action_message_buffer_length = 0;
-      VCSEC_ClosureMoveRequest closureMoveRequest = VCSEC_ClosureMoveRequest_init_default; // initialise to do nothing on all
-      switch (moveWhat)
-      { // For the requested item, change the do nothing to do something
-        case VCSEC_ClosureMoveRequest_rearTrunk_tag:
-          closureMoveRequest.rearTrunk = moveType;
-          break;
-        case VCSEC_ClosureMoveRequest_frontTrunk_tag:
-          closureMoveRequest.frontTrunk = moveType;
-          break;
-        case VCSEC_ClosureMoveRequest_chargePort_tag:
-          closureMoveRequest.chargePort = moveType;
-          break;
-        case VCSEC_ClosureMoveRequest_frontDriverDoor_tag:
-          closureMoveRequest.frontDriverDoor = moveType;
-          break;
-        default:
-          ESP_LOGE (TAG, "Unhandled moveWhat requested %d", moveWhat);
-          return 1;
-      }
+      state_ = BreakerState::CLOSED;
+      failures_ = 0;
+    }
 
-      int return_code = tesla_ble_client_->buildVCSECClosureMoveRequestMessage (closureMoveRequest, static_message_buffer_, &action_message_buffer_length);
-      if (return_code != 0)
-      {
-        if (return_code == TeslaBLE::TeslaBLE_Status_E_ERROR_INVALID_SESSION)
-        {
-          auto session = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
-          invalidateSession (UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY);
-        }
-        ESP_LOGE (TAG, "Failed to build ClosureMoveRequest message");
-        return return_code;
-      }
+    BLETokenBucket &TeslaBLEVehicle::bucket (UniversalMessage_Domain domain)
+    {
+      return (domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) ? infotainment_bucket_ : vcsec_bucket_;
+    }
 
-      return_code = writeBLE(static_message_buffer_, action_message_buffer_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
-      if (return_code != 0)
+    bool TeslaBLEVehicle::mayRequest (UniversalMessage_Domain domain, const BLECommand &command, uint32_t now)
+    { // Whether the domain has a token to spare for the command's next message, commandSent takes it once the message is queued
+      if (bucket(domain).available(now))
       {
-        ESP_LOGE (TAG, "Failed to send ClosureMoveRequest message");
-        return return_code;
+        return true;
       }
-      return 0;
+      ESP_LOGV(TAG, "[%s] Held back by the %s request rate (%.2f/s)", command.name(), domain_to_string(domain), bucket(domain).rate());
+      return false;
     }
 
-    void TeslaBLEVehicle::placeAtFrontOfQueue (UniversalMessage_Domain domain,
-                                               std::function<int()> execute,
-                                               std::string execute_name,
-                                               BLE_CarServer_VehicleAction action)
+    void TeslaBLEVehicle::carBusy (UniversalMessage_Domain domain, int index)
+    /*
+    *   The car turned a request away with WAIT or BUSY, so slow down requests to that domain. The command it was for (index in
+    *   the queue, -1 if unknown) is sent again once the rate allows, and the attempt doesn't count against its retries.
+    */
     {
-      if (command_queue_.size() == 0)
-      { // Queue is empty, place new command and nothing more to do
-        command_queue_.emplace (domain, execute, execute_name, action); // This swaps the original first and new command
+      uint32_t now = millis();
+      bucket(domain).throttle(now);
+      throttle_events_++;
+      publishSensor (NumericSensorId::BleThrottleEvents, throttle_events_);
+      ESP_LOGW(TAG, "%s is busy, request rate cut to %.2f/s", domain_to_string(domain), bucket(domain).rate());
+      if ((index < 0) or (static_cast<size_t>(index) >= command_queue_.size()))
+      {
         return;
       }
-      else
-      { // At least one command on queue. If the command at the front of the queue is in progress, it needs to stay there so it can finish.
-        BLECommand moving_command = command_queue_.front();
-        command_queue_.pop();
-        if (moving_command.state == BLECommandState::IDLE)
-        { // If the command at the front hasn't started, it goes behind the new action command
-          command_queue_.emplace (domain, execute, execute_name, action); // This swaps the original first and new command
-          command_queue_.push (moving_command); // Once the q has been cycled, this will 2nd
-        } else
-        { // If the command at the front has started, the new command goes behind it
-          command_queue_.push (moving_command);
-          command_queue_.emplace (domain, execute, execute_name, action); // Once the q has been cycled, this will 2nd
-        }
-        /*
-        *   At this point the back of the queue is either new command last, original front command just in front, or vice versa
-        *   depending on whether the original front command was in progress or not. Now just pop and push (to the back) all
-        *   remaining queue commands (if any).
-        */
-        int rest = command_queue_.size() - 2; // The 2 at the back will end up at the front.
-        for (int i = 0; i < rest; i++) // Loop won't execute if only 2 in q
+      BLECommand &command = command_queue_.at(index);
+      if ((command.state == BLECommandState::WAITING_FOR_RESPONSE) and (command.sends_to() == domain))
+      {
+        command.state = BLECommandState::READY;
+        command.last_tx_at = now;
+        if (command.retry_count > 0)
         {
-          BLECommand moving_command = command_queue_.front();
-          command_queue_.pop(); // Pop off front...
-          command_queue_.push (moving_command); // ... and push to the back
+          command.retry_count--;
         }
       }
     }
 
-    int TeslaBLEVehicle::wakeVehicle()
+    void TeslaBLEVehicle::requestGetOnSet (BLE_CarServer_VehicleAction action)
+    /*
+    *   Asks for the data a completed set affects so its outcome is seen. Joins any poll already waiting rather than costing a
+    *   round trip of its own.
+    */
+    {
+      switch (get_action_detail(action).getOnSet)
+      {
+        case GetOnSet::GetChargeState:
+          requestVehicleData (vehicle_data_bit(BLE_CarServer_VehicleAction::GET_CHARGE_STATE));
+          break;
+        case GetOnSet::GetClimateState:
+          requestVehicleData (vehicle_data_bit(BLE_CarServer_VehicleAction::GET_CLIMATE_STATE));
+          break;
+        case GetOnSet::GetDriveState:
+          requestVehicleData (vehicle_data_bit(BLE_CarServer_VehicleAction::GET_DRIVE_STATE));
+          break;
+        case GetOnSet::GetClosureState:
+          requestVehicleData (vehicle_data_bit(BLE_CarServer_VehicleAction::GET_CLOSURES_STATE));
+          break;
+        default:
+          break; // do nothing
+      }
+    }
+
+    BLECommandHandle TeslaBLEVehicle::wakeVehicle()
     {
       ESP_LOGI(TAG, "Waking vehicle");
       if (binary_sensors_[static_cast<size_t>(BinarySensorId::IsAsleep)]->state == false)
@@ -1439,76 +2880,53 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
 
       // enqueue command
       ESP_LOGI(TAG, "Adding wakeVehicle command to queue");
-        placeAtFrontOfQueue (UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY,
-          [this]()
-          {
-            int return_code = this->sendVCSECActionMessage(VCSEC_RKEAction_E_RKE_ACTION_WAKE_VEHICLE);
-            if (return_code != 0)
-            {
-              ESP_LOGE(TAG, "Failed to send wake command");
-              return return_code;
-            }
-            return 0;
-          },
-          "wake vehicle");
-      return 0;
+      BLECommand command (UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY, BLECommandKind::WAKE);
+      BLECommandHandle handle = assignHandle (command);
+      placeAtFrontOfQueue (command);
+      return handle;
     }
 
-    int TeslaBLEVehicle::lockVehicle (VCSEC_RKEAction_E lock)
+    BLECommandHandle TeslaBLEVehicle::lockVehicle (VCSEC_RKEAction_E lock)
     {
       ESP_LOGI (TAG, "(Un)locking) vehicle %d", lock);
       // enqueue command
+      BLECommand command;
       switch (lock)
       {
         case VCSEC_RKEAction_E_RKE_ACTION_UNLOCK:
           ESP_LOGI(TAG, "Adding unlock Vehicle command to queue");
-          placeAtFrontOfQueue (UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY, 
-            [this]()
-            {
-              int return_code = this->sendVCSECActionMessage(VCSEC_RKEAction_E_RKE_ACTION_UNLOCK);
-              if (return_code != 0)
-              {
-                ESP_LOGE(TAG, "Failed to send lock command");
-                return return_code;
-              }
-              return 0;
-            },
-            "unlock vehicle");
+          command = BLECommand (UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY, BLECommandKind::UNLOCK);
           break;
         case VCSEC_RKEAction_E_RKE_ACTION_LOCK:
           ESP_LOGI(TAG, "Adding lock Vehicle command to queue");
-          placeAtFrontOfQueue (UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY, 
-            [this]()
-            {
-              int return_code = this->sendVCSECActionMessage(VCSEC_RKEAction_E_RKE_ACTION_LOCK);
-              if (return_code != 0)
-              {
-                ESP_LOGE(TAG, "Failed to send lock command");
-                return return_code;
-              }
-              return 0;
-            },
-            "lock vehicle");
+          command = BLECommand (UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY, BLECommandKind::LOCK);
           break;
         default:
           ESP_LOGE(TAG, "Invalid lock request");
-          return -1;
+          return 0;
       }
-      return 0;
+      BLECommandHandle handle = assignHandle (command);
+      placeAtFrontOfQueue (command);
+      return handle;
     }
 
     int TeslaBLEVehicle::sendVCSECInformationRequest()
     {
       ESP_LOGD(TAG, "Building sendVCSECInformationRequest");
       size_t message_length = 0;
-      int return_code = tesla_ble_client_->buildVCSECInformationRequestMessage(VCSEC_InformationRequestType_INFORMATION_REQUEST_TYPE_GET_STATUS, static_message_buffer_, &message_length);
+      unsigned char *message_buffer = reserveBLE();
+      if (message_buffer == nullptr)
+      {
+        return 1;
+      }
+      int return_code = tesla_ble_client_->buildVCSECInformationRequestMessage(VCSEC_InformationRequestType_INFORMATION_REQUEST_TYPE_GET_STATUS, message_buffer, &message_length);
       if (return_code != 0)
       {
         ESP_LOGE(TAG, "Failed to build VCSECInformationRequestMessage");
         return return_code;
       }
 
-      return_code = writeBLE(static_message_buffer_, message_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
+      return_code = writeBLE(message_buffer, message_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE, BLETXPriority::CONTROL);
       if (return_code != 0)
       {
         ESP_LOGE(TAG, "Failed to send VCSECInformationRequestMessage");
@@ -1520,94 +2938,211 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
     void TeslaBLEVehicle::enqueueVCSECInformationRequest(bool force)
     {
       ESP_LOGD(TAG, "Enqueueing VCSECInformationRequest");
-      std::string action_str = "data update";
       if (force)
       {
         one_off_update_ = true;
         number_updates_since_connection_ = 0; // Ensures a one off update reads everything
-        action_str = "data update | forced";
       }
-
-      command_queue_.emplace(
-          force ? UniversalMessage_Domain_DOMAIN_INFOTAINMENT : UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY, [this]()
-          {
-        int return_code = this->sendVCSECInformationRequest();
-        if (return_code != 0)
-        {
-          ESP_LOGE(TAG, "Failed to send VCSECInformationRequest");
-          return return_code;
-        }
-        return 0; },
-          action_str);
+      BLECommand command (force ? UniversalMessage_Domain_DOMAIN_INFOTAINMENT : UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY,
+                          force ? BLECommandKind::DATA_UPDATE_FORCED : BLECommandKind::DATA_UPDATE);
+      if (command.probe() and breaker_.open())
+      {
+        placeProbe(command);
+        return;
+      }
+      if (command_queue_.find_waiting(command.kind, command.action) != nullptr)
+      { // One is already waiting, it will fetch the same data
+        ESP_LOGD(TAG, "[%s] Already queued", command.name());
+        return;
+      }
+      if (!command_queue_.push(command))
+      {
+        ESP_LOGW(TAG, "[%s] Command queue full, dropping command", command.name());
+      }
     }
 
-    int TeslaBLEVehicle::sendCarServerVehicleActionMessage(BLE_CarServer_VehicleAction action, int param)
+    BLECommandHandle TeslaBLEVehicle::sendCarServerVehicleActionMessage(BLE_CarServer_VehicleAction action, int param)
     /*
-    *   Causes the appropriate message to be built using the ACTION_SPECIFICS table.
+    *   Causes the appropriate message to be built using the ACTION_SPECIFICS table. Returns the handle the command's outcome
+    *   is reported with, or 0 if it couldn't be queued.
     */
     {
       if (get_action_detail(action).localActionDef != action)
       {
         ESP_LOGE (TAG, "[%s] Action requested %d not that in specifics %d", get_action_detail(action).action_str, action, get_action_detail(action).localActionDef);
-        return 1;
+        return 0;
       }
       /*
       *   If this is a VehicleActionMessage message, we want it as near the front of the queue as possible (the first command
       *   might be in progress so it needs to be just behind that).
       */
-      std::string action_str;
-      action_str = get_action_detail(action).action_str;
-      std::function<int()> execute_cmd;
-      execute_cmd = [this, action, action_str, param]()
-        {
-          size_t message_length = 0;
-          int return_code = 0;
-          ESP_LOGI(TAG, "[%s] Building message..", action_str.c_str());
-          //if (ACTION_SPECIFICS[action].whichMsg == GetVehicleDataMessage)
-          switch (get_action_detail(action).whichMsg)
+      /*
+      *   A get already waiting will fetch the same data, and a set of the same action that hasn't started yet can just take the
+      *   new value. So dragging a slider only sends the value it ends up on. Presses (see coalesce in ACTION_SPECIFICS) are
+      *   always queued, so pressing the horn twice sounds it twice and a play/pause toggle ends up where it should.
+      */
+      BLECommand *waiting = get_action_detail(action).coalesce ?
+                            command_queue_.find_waiting(BLECommandKind::CARSERVER_ACTION, action) : nullptr;
+      if (waiting != nullptr)
+      {
+        if (get_action_detail(action).whichMsg == AllowedMsg::VehicleActionMessage)
+        {
+          ESP_LOGI(TAG, "[%s] Updating queued command (param %d -> %d)", waiting->name(), static_cast<int>(waiting->param), param);
+          waiting->param = param;
+        }
+        else
+        {
+          ESP_LOGD(TAG, "[%s] Already queued", waiting->name());
+        }
+        waiting->renew(millis());
+        return (waiting->handle != 0) ? waiting->handle : assignHandle(*waiting); // Both callers wait on the one command
+      }
+      ESP_LOGI(TAG, "[%s] Adding command to queue (param=%d)", get_action_detail(action).action_str, static_cast<int>(param));
+      BLECommand command (UniversalMessage_Domain_DOMAIN_INFOTAINMENT, BLECommandKind::CARSERVER_ACTION, action, param);
+      BLECommandHandle handle = assignHandle (command);
+      if (get_action_detail(action).whichMsg == AllowedMsg::VehicleActionMessage)
+      {
+        placeAtFrontOfQueue (command);
+      }
+      else if (!command_queue_.push(command))
+      { // No priority so put it at the back
+        ESP_LOGW(TAG, "[%s] Command queue full, dropping command", command.name());
+        return 0;
+      }
+      return handle;
+    }
+
+    int TeslaBLEVehicle::requestVehicleData(uint32_t categories)
+    /*
+    *   Queues a GET_VEHICLE_DATA for the categories in the mask (see vehicle_data_bit). If one is already waiting the categories
+    *   are added to it, so however many gets fall due before it is sent they only cost a single round trip.
+    */
+    {
+      BLECommand *waiting = command_queue_.find_waiting(BLECommandKind::CARSERVER_ACTION, BLE_CarServer_VehicleAction::GET_VEHICLE_DATA);
+      if (waiting != nullptr)
+      {
+        ESP_LOGD(TAG, "[%s] Adding to queued command (mask 0x%x -> 0x%x)", waiting->name(),
+                 static_cast<unsigned>(waiting->param), static_cast<unsigned>(waiting->param | categories));
+        waiting->param = static_cast<int32_t>(static_cast<uint32_t>(waiting->param) | categories);
+        waiting->renew(millis());
+        return 0;
+      }
+      BLECommand command (UniversalMessage_Domain_DOMAIN_INFOTAINMENT, BLECommandKind::CARSERVER_ACTION,
+                          BLE_CarServer_VehicleAction::GET_VEHICLE_DATA, static_cast<int32_t>(categories));
+      ESP_LOGI(TAG, "[%s] Adding command to queue (mask 0x%x)", command.name(), static_cast<unsigned>(categories));
+      if (!command_queue_.push(command))
+      {
+        ESP_LOGW(TAG, "[%s] Command queue full, dropping command", command.name());
+        return 1;
+      }
+      return 0;
+    }
+
+    int TeslaBLEVehicle::buildGetVehicleDataMessage(uint32_t categories, unsigned char *message_buffer, size_t *message_length)
+    /*
+    *   Builds a single signed GetVehicleData asking for every category in the mask. The car answers with one VehicleData
+    *   holding all of them.
+    */
+    {
+      CarServer_Action action = CarServer_Action_init_default;
+      action.which_action_msg = CarServer_Action_vehicleAction_tag;
+      action.action_msg.vehicleAction.which_vehicle_action_msg = CarServer_VehicleAction_getVehicleData_tag;
+      CarServer_GetVehicleData &get = action.action_msg.vehicleAction.vehicle_action_msg.getVehicleData;
+      get = CarServer_GetVehicleData_init_default;
+      for (const auto &detail : ACTION_SPECIFICS)
+      {
+        if ((detail.whichMsg != AllowedMsg::GetVehicleDataMessage) or ((categories & vehicle_data_bit(detail.localActionDef)) == 0))
+          continue;
+        switch (detail.actionTag)
+        {
+          case CarServer_GetVehicleData_getChargeState_tag:
+            get.has_getChargeState = true;
+            break;
+          case CarServer_GetVehicleData_getClimateState_tag:
+            get.has_getClimateState = true;
+            break;
+          case CarServer_GetVehicleData_getDriveState_tag:
+            get.has_getDriveState = true;
+            break;
+          case CarServer_GetVehicleData_getLocationState_tag:
+            get.has_getLocationState = true;
+            break;
+          case CarServer_GetVehicleData_getClosuresState_tag:
+            get.has_getClosuresState = true;
+            break;
+          case CarServer_GetVehicleData_getTirePressureState_tag:
+            get.has_getTirePressureState = true;
+            break;
+          default:
+            break; // GET_VEHICLE_DATA itself
+        }
+      }
+
+      pb_byte_t payload_buffer[UniversalMessage_RoutableMessage_size];
+      size_t payload_length = 0;
+      int return_code = tesla_ble_client_->buildCarServerActionPayload(&action, payload_buffer, &payload_length);
+      if (return_code != 0)
+      {
+        ESP_LOGE(TAG, "Failed to build GetVehicleData payload");
+        return return_code;
+      }
+      return tesla_ble_client_->buildUniversalMessageWithPayload(payload_buffer, payload_length, UniversalMessage_Domain_DOMAIN_INFOTAINMENT,
+                                                                  message_buffer, message_length, true);
+    }
+
+    int TeslaBLEVehicle::executeCarServerAction(BLE_CarServer_VehicleAction action, int32_t param)
+    /*
+    *   Builds and sends the message for a CarServer command using the ACTION_SPECIFICS table.
+    */
+    {
+      const char *action_str = get_action_detail(action).action_str;
+      size_t message_length = 0;
+      int return_code = 0;
+      ESP_LOGI(TAG, "[%s] Building message..", action_str);
+      unsigned char *message_buffer = reserveBLE();
+      if (message_buffer == nullptr)
+      {
+        return 1;
+      }
+      switch (get_action_detail(action).whichMsg)
+      {
+        case AllowedMsg::GetVehicleDataMessage:
+        // Need to create a get vehicle data message
+          if (action == BLE_CarServer_VehicleAction::GET_VEHICLE_DATA)
           {
-            case AllowedMsg::GetVehicleDataMessage:
-            // Need to create a get vehicle data message
-              return_code = tesla_ble_client_->buildCarServerGetVehicleDataMessage (static_message_buffer_, &message_length, get_action_detail(action).actionTag);
-              break;
-            case AllowedMsg::VehicleActionMessage:
-            // Need to create a vehicle action message
-              return_code = tesla_ble_client_->buildCarServerVehicleActionMessage (static_cast<int32_t>(param), static_message_buffer_, &message_length, get_action_detail(action).actionTag);
-              if ((action == BLE_CarServer_VehicleAction::SET_CHARGING_SWITCH) and (param == 1))
-              { // If charging has been requested, enable continuous polling
-                car_is_charging_ = ChargingJustStarted; //true;
-              }
-              break;
-            default:
-              ESP_LOGE(TAG, "Invalid action: %d", static_cast<int>(action));
-              return 1;
+            return_code = buildGetVehicleDataMessage (static_cast<uint32_t>(param), message_buffer, &message_length);
           }
-          if (return_code != 0)
+          else
           {
-            ESP_LOGE(TAG, "[%s] Failed to build message", action_str.c_str());
-            auto session = tesla_ble_client_->getPeer(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
-            if (return_code == TeslaBLE::TeslaBLE_Status_E_ERROR_INVALID_SESSION)
-            {
-              invalidateSession(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
-            }
-            return return_code;
+            return_code = tesla_ble_client_->buildCarServerGetVehicleDataMessage (message_buffer, &message_length, get_action_detail(action).actionTag);
           }
-          return_code = writeBLE(static_message_buffer_, message_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
-          if (return_code != 0)
-          {
-            ESP_LOGE(TAG, "[%s] Failed to send message", action_str.c_str());
-            return return_code;
+          break;
+        case AllowedMsg::VehicleActionMessage:
+        // Need to create a vehicle action message
+          return_code = tesla_ble_client_->buildCarServerVehicleActionMessage (param, message_buffer, &message_length, get_action_detail(action).actionTag);
+          if ((action == BLE_CarServer_VehicleAction::SET_CHARGING_SWITCH) and (param == 1))
+          { // If charging has been requested, enable continuous polling
+            car_is_charging_ = ChargingJustStarted; //true;
           }
-          return 0;
-        };
-        ESP_LOGI(TAG, "[%s] Adding command to queue (param=%d)", action_str.c_str(), static_cast<int>(param));
-      if (get_action_detail(action).whichMsg == AllowedMsg::VehicleActionMessage)
+          break;
+        default:
+          ESP_LOGE(TAG, "Invalid action: %d", static_cast<int>(action));
+          return 1;
+      }
+      if (return_code != 0)
       {
-        placeAtFrontOfQueue (UniversalMessage_Domain_DOMAIN_INFOTAINMENT, execute_cmd, action_str, action);
+        ESP_LOGE(TAG, "[%s] Failed to build message", action_str);
+        if (return_code == TeslaBLE::TeslaBLE_Status_E_ERROR_INVALID_SESSION)
+        {
+          invalidateSession(UniversalMessage_Domain_DOMAIN_INFOTAINMENT);
+        }
+        return return_code;
       }
-      else
-      { // No priority so put it at the back
-        command_queue_.emplace(UniversalMessage_Domain_DOMAIN_INFOTAINMENT, execute_cmd, action_str, action);
+      return_code = writeBLE(message_buffer, message_length, ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
+      if (return_code != 0)
+      {
+        ESP_LOGE(TAG, "[%s] Failed to send message", action_str);
+        return return_code;
       }
       return 0;
     }
@@ -1642,6 +3177,11 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
         break;
       case Signatures_Session_Info_Status_SESSION_INFO_STATUS_KEY_NOT_ON_WHITELIST:
         ESP_LOGE(TAG, "Session is invalid: Key not on whitelist");
+        if (breaker_.reject_key(millis()))
+        { // Every retry would be rejected the same way
+          ESP_LOGW(TAG, "Holding commands until the key is paired");
+          publishBreakerState();
+        }
         return 1;
       };
 
@@ -1660,38 +3200,51 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
         ESP_LOGE(TAG, "Failed to save %s session info to NVS", domain_str);
       }
 
-      if (!command_queue_.empty())
-      {
-        BLECommand current_command = command_queue_.front();
+      bool sampled = false;
+      for (UniversalMessage_Domain lane : COMMAND_LANES)
+      { // The command at the head of either lane waiting for this moves on straight away
+        int index = command_queue_.head(lane);
+        if (index < 0)
+        {
+          continue;
+        }
+        BLECommand &current_command = command_queue_.at(index);
+        bool awaited = (domain == UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY) ?
+                       (current_command.state == BLECommandState::WAITING_FOR_VCSEC_AUTH_RESPONSE) :
+                       (current_command.state == BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH_RESPONSE);
+        if (awaited and (current_command.retry_count == 1) and not sampled)
+        { // Only a request sent once gives an unambiguous round trip
+          sampleRTT(domain, millis() - current_command.last_tx_at);
+          sampled = true;
+        }
         if ((domain == UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY) &&
             (current_command.state == BLECommandState::WAITING_FOR_VCSEC_AUTH_RESPONSE))
         {
           switch (current_command.domain)
           {
           case UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY:
-            ESP_LOGV(TAG, "[%s] VCSEC authenticated, ready to execute", current_command.execute_name.c_str());
+            ESP_LOGV(TAG, "[%s] VCSEC authenticated, ready to execute", current_command.name());
             current_command.state = BLECommandState::READY;
             current_command.retry_count = 0;
             break;
           case UniversalMessage_Domain_DOMAIN_INFOTAINMENT:
-            ESP_LOGV(TAG, "[%s] VCSEC authenticated, queuing INFOTAINMENT auth", current_command.execute_name.c_str());
+            ESP_LOGV(TAG, "[%s] VCSEC authenticated, queuing INFOTAINMENT auth", current_command.name());
             current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
             current_command.retry_count = 0;
             break;
           case UniversalMessage_Domain_DOMAIN_BROADCAST:
-            ESP_LOGE(TAG, "[%s] Invalid state: VCSEC authenticated but no auth required", current_command.execute_name.c_str());
+            ESP_LOGE(TAG, "[%s] Invalid state: VCSEC authenticated but no auth required", current_command.name());
             // pop command
-            command_queue_.pop();
-            return 0;
+            finishCommand(index, BLECommandOutcome::FAILURE);
+            continue;
           }
         }
         else if ((domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) && (current_command.state == BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH_RESPONSE))
         {
-          ESP_LOGV(TAG, "[%s] INFOTAINMENT authenticated, ready to execute", current_command.execute_name.c_str());
+          ESP_LOGV(TAG, "[%s] INFOTAINMENT authenticated, ready to execute", current_command.name());
           current_command.state = BLECommandState::READY;
           current_command.retry_count = 0;
         }
-        command_queue_.front() = current_command;
       }
       return 0;
     }
@@ -1700,28 +3253,27 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
     {
       auto session = tesla_ble_client_->getPeer(domain);
       session->setIsValid(false);
-      // check if we need to update the state in the command queue
-      if (!command_queue_.empty())
+      // check if we need to update the state of the command at the head of the domain's lane
+      int index = command_queue_.head(domain);
+      if (index >= 0)
       {
-        BLECommand current_command = command_queue_.front();
+        BLECommand &current_command = command_queue_.at(index);
         switch (current_command.domain)
         {
         case UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY:
           if (domain == UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY)
           {
-            ESP_LOGW(TAG, "[%s] VCSEC session invalid, requesting new session info..", current_command.execute_name.c_str());
+            ESP_LOGW(TAG, "[%s] VCSEC session invalid, requesting new session info..", current_command.name());
             current_command.state = BLECommandState::WAITING_FOR_VCSEC_AUTH;
           }
-          command_queue_.front() = current_command;
           break;
         case UniversalMessage_Domain_DOMAIN_INFOTAINMENT:
           if (domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT)
           {
-            ESP_LOGW(TAG, "[%s] INFOTAINMENT session invalid, requesting new session info..", current_command.execute_name.c_str());
+            ESP_LOGW(TAG, "[%s] INFOTAINMENT session invalid, requesting new session info..", current_command.name());
             current_command.state = BLECommandState::WAITING_FOR_INFOTAINMENT_AUTH;
             number_updates_since_connection_ = 0; // Infotainment will be reset so enable a read of all the sensors
           }
-          command_queue_.front() = current_command;
           break;
         default:
           break;
@@ -1872,7 +3424,7 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
             }
             publishSensor (TextSensorId::LastUpdate, ctime(&timestamp));
           }
-          else if (carserver_response.response_msg.vehicleData.has_drive_state)
+          if (carserver_response.response_msg.vehicleData.has_drive_state)
           {
             if (carserver_response.response_msg.vehicleData.drive_state.has_shift_state)
             {
@@ -1893,7 +3445,7 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
             }
             publishSensor (TextSensorId::LastUpdate, ctime(&timestamp));
           }
-          else if (carserver_response.response_msg.vehicleData.has_climate_state)
+          if (carserver_response.response_msg.vehicleData.has_climate_state)
           {
             if (carserver_response.response_msg.vehicleData.climate_state.which_optional_is_climate_on)
             {
@@ -1938,7 +3490,7 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
             }
             publishSensor (TextSensorId::LastUpdate, ctime(&timestamp));
           }
-          else if (carserver_response.response_msg.vehicleData.has_closures_state)
+          if (carserver_response.response_msg.vehicleData.has_closures_state)
           {
             if (carserver_response.response_msg.vehicleData.closures_state.which_optional_door_open_trunk_rear)
             {
@@ -1974,7 +3526,7 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
             }
             publishSensor (TextSensorId::LastUpdate, ctime(&timestamp));
           }
-          else if (carserver_response.response_msg.vehicleData.has_tire_pressure_state)
+          if (carserver_response.response_msg.vehicleData.has_tire_pressure_state)
           {
             if (carserver_response.response_msg.vehicleData.tire_pressure_state.which_optional_tpms_pressure_fl and
                 carserver_response.response_msg.vehicleData.tire_pressure_state.which_optional_tpms_pressure_fr and
@@ -2001,7 +3553,7 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
       return 0;
     }
 
-    int TeslaBLEVehicle::handleVCSECVehicleStatus(VCSEC_VehicleStatus vehicleStatus)
+    int TeslaBLEVehicle::handleVCSECVehicleStatus(const VCSEC_VehicleStatus &vehicleStatus)
     {
       log_vehicle_status(TAG, &vehicleStatus);
       switch (vehicleStatus.vehicleSleepStatus)
@@ -2096,7 +3648,7 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
           this->status_clear_warning();
           ble_disconnected_ = BleConnected;
           number_updates_since_connection_ = 0; //Reset update loop counter
-          publishSensor (NumericSensorId::BleDisconnectedTime, 0);
+          pushGattEvent(BLEGattEventType::CONNECTED);
 
           // generate random connection id 16 bytes
           pb_byte_t connection_id[16];
@@ -2106,6 +3658,9 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
           }
           ESP_LOGD(TAG, "Connection ID: %s", format_hex(connection_id, 16).c_str());
           tesla_ble_client_->setConnectionID(connection_id);
+          this->ble_negotiated_mtu_ = param->open.mtu;
+          pushGattEvent(BLEGattEventType::MTU, param->open.mtu);
+          requestLinkUpgrade();
         }
         break;
       }
@@ -2124,13 +3679,8 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
         this->node_state = espbt::ClientState::IDLE;
 
         ble_disconnected_ = BleDisconnected;
-        // set binary sensors to unknown
-        if (ble_disconnected_min_time_ == 0)
-        { // If delay time zero, then set Unknown on any disconnect however fleeting
-            this->setSensors(false);
-            ble_disconnected_ = BleDisconnectedUnknownsSet;
-        }
         ble_disconnected_time_ = millis();
+        pushGattEvent(BLEGattEventType::CLOSED); // Sets sensors to unknown if configured to straight away
 
         this->status_set_warning("BLE connection closed");
         break;
@@ -2141,6 +3691,11 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
         this->handle_ = 0;
         this->read_handle_ = 0;
         this->write_handle_ = 0;
+        this->ble_tx_congested_ = false;
+        this->data_length_requested_ = false;
+        this->ble_negotiated_mtu_ = BLOCK_LENGTH + ATT_HEADER_LENGTH;
+        this->ble_rx_ring_.reset(); // Before the flag, so the loop sees which messages are stale when it applies it
+        this->ble_disconnect_pending_ = true;
         this->node_state = espbt::ClientState::DISCONNECTING;
         ESP_LOGW(TAG, "Disconnected!");
         break;
@@ -2172,6 +3727,33 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
         this->write_handle_ = writeChar->handle;
 
         ESP_LOGD(TAG, "Successfully set read and write char handle");
+
+        // The BLE client normally exchanges MTUs on connect, only ask again if that left it short of a larger MTU. The local
+        // MTU is left as the BLE component set it, it applies to every client on the device. The outcome arrives in
+        // ESP_GATTC_CFG_MTU_EVT
+        if (this->ble_negotiated_mtu_ < PREFERRED_MTU)
+        {
+          esp_err_t mtu_status = esp_ble_gattc_send_mtu_req(this->parent()->get_gattc_if(), this->parent()->get_conn_id());
+          if (mtu_status != ESP_OK)
+          {
+            ESP_LOGW(TAG, "MTU request failed, status=%d, keeping MTU %d", mtu_status, this->ble_negotiated_mtu_);
+          }
+        }
+        break;
+      }
+
+      case ESP_GATTC_CFG_MTU_EVT:
+      {
+        if (param->cfg_mtu.conn_id != this->parent()->get_conn_id())
+          break;
+        if (param->cfg_mtu.status != ESP_GATT_OK)
+        {
+          ESP_LOGW(TAG, "MTU exchange refused, status=%d, using %d byte chunks", param->cfg_mtu.status, BLOCK_LENGTH);
+          pushGattEvent(BLEGattEventType::MTU, 0);
+          break;
+        }
+        this->ble_negotiated_mtu_ = param->cfg_mtu.mtu;
+        pushGattEvent(BLEGattEventType::MTU, param->cfg_mtu.mtu);
         break;
       }
 
@@ -2247,10 +3829,27 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
         if (param->write.status != ESP_GATT_OK)
         {
           ESP_LOGE(TAG, "write char failed, error status = %x", param->write.status);
+          if (this->reliable_writes_)
+          {
+            pushGattEvent(BLEGattEventType::WRITE_FAILED);
+          }
           break;
         }
         ESP_LOGV(TAG, "Write char success");
+        if (this->reliable_writes_)
+        { // Reported for writes without response too, but only a confirmed chunk is waited on
+          pushGattEvent(BLEGattEventType::WRITE_CONFIRMED);
+        }
+        break;
+
+      case ESP_GATTC_CONGEST_EVT:
+      {
+        if (param->congest.conn_id != this->parent()->get_conn_id())
+          break;
+        this->ble_tx_congested_ = param->congest.congested;
+        ESP_LOGD(TAG, "BLE link %s", param->congest.congested ? "congested, pausing TX" : "no longer congested, resuming TX");
         break;
+      }
 
       case ESP_GATTC_NOTIFY_EVT:
       {
@@ -2260,9 +3859,11 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
           break;
         }
         ESP_LOGV(TAG, "RAM left: %ld, minimum was: %ld", esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
-        // copy notify value to buffer
-        std::vector<unsigned char> buffer(param->notify.value, param->notify.value + param->notify.value_len);
-        ble_read_queue_.emplace(buffer);
+        ESP_LOGV(TAG, "BLE RX chunk: %s", format_hex(param->notify.value, param->notify.value_len).c_str());
+        if (!this->ble_rx_ring_.append(param->notify.value, param->notify.value_len, millis()))
+        {
+          ESP_LOGE(TAG, "BLE RX: Message exceeds max BLE message size, dropping it");
+        }
         break;
       }
 
@@ -2271,5 +3872,43 @@ if (ble_disconnected_ != BleConnected) // While disconnected update duration of
         break;
       }
     }
+
+    void TeslaBLEVehicle::gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
+    {
+      switch (event)
+      {
+      case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+      {
+        // Carries no peer address, so only the outcome of our own request is taken, not that for another client's link
+        if (!this->data_length_requested_.exchange(false))
+          break;
+        if (param->pkt_data_length_cmpl.status != ESP_BT_STATUS_SUCCESS)
+        {
+          ESP_LOGW(TAG, "Data length extension refused, status=%d", param->pkt_data_length_cmpl.status);
+          break;
+        }
+        ESP_LOGI(TAG, "Data length set, TX %d bytes, RX %d bytes", param->pkt_data_length_cmpl.params.tx_len, param->pkt_data_length_cmpl.params.rx_len);
+        pushGattEvent(BLEGattEventType::DATA_LENGTH, param->pkt_data_length_cmpl.params.tx_len);
+        break;
+      }
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+      case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+      {
+        if (memcmp(param->phy_update.bda, this->parent()->get_remote_bda(), sizeof(esp_bd_addr_t)) != 0)
+          break;
+        if (param->phy_update.status != ESP_BT_STATUS_SUCCESS)
+        {
+          ESP_LOGW(TAG, "PHY update refused, status=%d", param->phy_update.status);
+          break;
+        }
+        ESP_LOGI(TAG, "PHY updated, TX PHY %d, RX PHY %d", param->phy_update.tx_phy, param->phy_update.rx_phy);
+        pushGattEvent(BLEGattEventType::PHY, param->phy_update.tx_phy); // 1 for 1M, 2 for 2M, 3 for Coded
+        break;
+      }
+#endif
+      default:
+        break;
+      }
+    }
   } // namespace tesla_ble_vehicle
 } // namespace esphome
@@ -6,15 +6,20 @@
 #include <vector>
 #include <queue>
 #include <array>
+#include <atomic>
 #include <unordered_map>
 #include <functional>
+#include <type_traits>
 
+#include <esp_gap_ble_api.h>
 #include <esp_gattc_api.h>
+#include <esp_gatt_common_api.h>
 #include <esphome/components/binary_sensor/binary_sensor.h>
 #include <esphome/components/text_sensor/text_sensor.h>
 #include <esphome/components/sensor/sensor.h>
 #include <esphome/components/ble_client/ble_client.h>
 #include <esphome/components/esp32_ble_tracker/esp32_ble_tracker.h>
+#include <esphome/core/automation.h>
 #include <esphome/core/component.h>
 #include <esphome/core/log.h>
 
@@ -45,6 +50,7 @@ namespace esphome
             GET_LOCATION_STATE,
             GET_CLOSURES_STATE,
             GET_TYRES_STATE,
+            GET_VEHICLE_DATA, // Any of the gets above in one message, the param holds a mask of them
             SET_CHARGING_SWITCH,
             SET_CHARGING_AMPS,
             SET_CHARGING_LIMIT,
@@ -83,6 +89,25 @@ namespace esphome
             GetClosureState,
             Invalid // Eg a data read, sensor not yet implemented, etc
         };
+        enum class CommandPolicy : uint8_t
+        /*
+        *   How long a command stays worth doing and how often it's sent before giving up, see COMMAND_POLICIES.
+        */
+        {
+            Poll,  // Background read, soon superseded by the next poll
+            Action // Something asked for by a user or an automation
+        };
+        struct CommandPolicyDetail
+        {
+            CommandPolicy policy;
+            uint32_t deadline;  // Time from being queued after which it's dropped, done or not (ms)
+            uint8_t maxRetries; // Times its message is sent before giving up
+        };
+        static constexpr std::array<CommandPolicyDetail, 2> COMMAND_POLICIES
+        {{
+            {CommandPolicy::Poll,   20 * 1000, 3},
+            {CommandPolicy::Action, 60 * 1000, 5}
+        }};
 
         struct ActionMessageDetail
         /*
@@ -97,34 +122,43 @@ namespace esphome
             int actionTag;
             GetOnSet getOnSet;
             int numberUpdatesBetweenGets; // Only used for GetVehicleDataMessage
+            CommandPolicy policy;
+            bool coalesce; // A request while one is waiting is merged into it. Only for reads and sets whose latest value is all
+                           // that matters, never for presses (horn, lights, media) where each one counts
         };
-        static constexpr std::array<ActionMessageDetail, 23> ACTION_SPECIFICS // Don't forget to increase the size when adding a row
+        static constexpr std::array<ActionMessageDetail, 24> ACTION_SPECIFICS // Don't forget to increase the size when adding a row
         {{
-            {BLE_CarServer_VehicleAction::DO_NOTHING,                       "",                          AllowedMsg::Empty,                 0,                                                              GetOnSet::Invalid,         0},
-            {BLE_CarServer_VehicleAction::GET_CHARGE_STATE,                 "getChargeState",            AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getChargeState_tag,                    GetOnSet::Invalid,         1},
-            {BLE_CarServer_VehicleAction::GET_CLIMATE_STATE,                "getClimateState",           AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getClimateState_tag,                   GetOnSet::Invalid,         5},
-            {BLE_CarServer_VehicleAction::GET_DRIVE_STATE,                  "getDriveState",             AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getDriveState_tag,                     GetOnSet::Invalid,         1},
-            {BLE_CarServer_VehicleAction::GET_LOCATION_STATE,               "getLocationState",          AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getLocationState_tag,                  GetOnSet::Invalid,         10},
-            {BLE_CarServer_VehicleAction::GET_CLOSURES_STATE,               "getClosuresState",          AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getClosuresState_tag,                  GetOnSet::Invalid,         6},
-            {BLE_CarServer_VehicleAction::GET_TYRES_STATE,                  "getTyresState",             AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getTirePressureState_tag,              GetOnSet::Invalid,         17},
-            {BLE_CarServer_VehicleAction::SET_CHARGING_SWITCH,              "setChargingSwitch",         AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_chargingStartStopAction_tag,            GetOnSet::GetChargeState,  0},
-            {BLE_CarServer_VehicleAction::SET_CHARGING_AMPS,                "setChargingAmps",           AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_setChargingAmpsAction_tag,              GetOnSet::GetChargeState,  0},
-            {BLE_CarServer_VehicleAction::SET_CHARGING_LIMIT,               "setChargingLimit",          AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_chargingSetLimitAction_tag,             GetOnSet::GetChargeState,  0},
-            {BLE_CarServer_VehicleAction::SET_SENTRY_SWITCH,                "setSentrySwitch",           AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_vehicleControlSetSentryModeAction_tag,  GetOnSet::Invalid,         0},
-            {BLE_CarServer_VehicleAction::SET_HVAC_SWITCH,                  "setHVACSwitch",             AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_hvacAutoAction_tag,                     GetOnSet::GetClimateState, 0},
-            {BLE_CarServer_VehicleAction::SET_HVAC_STEERING_HEATER_SWITCH,  "setHVACSteeringHeatSwitch", AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_hvacSteeringWheelHeaterAction_tag,      GetOnSet::Invalid,         0},
-            {BLE_CarServer_VehicleAction::SET_OPEN_CHARGE_PORT_DOOR,        "setOpenChargePortDoor",     AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_chargePortDoorOpen_tag,                 GetOnSet::Invalid,         0},
-            {BLE_CarServer_VehicleAction::SET_CLOSE_CHARGE_PORT_DOOR,       "setCloseChargePortDoor",    AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_chargePortDoorClose_tag,                GetOnSet::Invalid,         0},
-            {BLE_CarServer_VehicleAction::SOUND_HORN,                       "soundHorn",                 AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_vehicleControlHonkHornAction_tag,       GetOnSet::Invalid,         0},
-            {BLE_CarServer_VehicleAction::FLASH_LIGHT,                      "flashLight",                AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_vehicleControlFlashLightsAction_tag,    GetOnSet::Invalid,         0},
-            {BLE_CarServer_VehicleAction::SET_WINDOWS_SWITCH,               "setWindowsSwitch",          AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_vehicleControlWindowAction_tag,         GetOnSet::GetClosureState, 0},
-            {BLE_CarServer_VehicleAction::DEFROST_CAR,                      "defrostCar",                AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_hvacSetPreconditioningMaxAction_tag,    GetOnSet::GetClimateState, 0},
-            {BLE_CarServer_VehicleAction::SET_CLIMATE_TEMP,                 "setClimateTemp",            AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_hvacTemperatureAdjustmentAction_tag,    GetOnSet::GetClimateState, 0},
-            {BLE_CarServer_VehicleAction::MEDIA_PLAY,                       "mediaPlay",                 AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_mediaPlayAction_tag,                    GetOnSet::Invalid,         0},
-            {BLE_CarServer_VehicleAction::MEDIA_NEXT_TRACK,                 "mediaNextTrack",            AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_mediaNextTrack_tag,                     GetOnSet::Invalid,         0},
-            {BLE_CarServer_VehicleAction::MEDIA_PREVIOUS_TRACK,             "mediaPreviousTrack",        AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_mediaPreviousTrack_tag,                 GetOnSet::Invalid,         0}
+            {BLE_CarServer_VehicleAction::DO_NOTHING,                       "",                          AllowedMsg::Empty,                 0,                                                              GetOnSet::Invalid,         0,  CommandPolicy::Action, false},
+            {BLE_CarServer_VehicleAction::GET_CHARGE_STATE,                 "getChargeState",            AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getChargeState_tag,                    GetOnSet::Invalid,         1,  CommandPolicy::Poll,   true},
+            {BLE_CarServer_VehicleAction::GET_CLIMATE_STATE,                "getClimateState",           AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getClimateState_tag,                   GetOnSet::Invalid,         5,  CommandPolicy::Poll,   true},
+            {BLE_CarServer_VehicleAction::GET_DRIVE_STATE,                  "getDriveState",             AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getDriveState_tag,                     GetOnSet::Invalid,         1,  CommandPolicy::Poll,   true},
+            {BLE_CarServer_VehicleAction::GET_LOCATION_STATE,               "getLocationState",          AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getLocationState_tag,                  GetOnSet::Invalid,         10, CommandPolicy::Poll,   true},
+            {BLE_CarServer_VehicleAction::GET_CLOSURES_STATE,               "getClosuresState",          AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getClosuresState_tag,                  GetOnSet::Invalid,         6,  CommandPolicy::Poll,   true},
+            {BLE_CarServer_VehicleAction::GET_TYRES_STATE,                  "getTyresState",             AllowedMsg::GetVehicleDataMessage, CarServer_GetVehicleData_getTirePressureState_tag,              GetOnSet::Invalid,         17, CommandPolicy::Poll,   true},
+            {BLE_CarServer_VehicleAction::GET_VEHICLE_DATA,                 "getVehicleData",            AllowedMsg::GetVehicleDataMessage, 0,                                                              GetOnSet::Invalid,         0,  CommandPolicy::Poll,   true},
+            {BLE_CarServer_VehicleAction::SET_CHARGING_SWITCH,              "setChargingSwitch",         AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_chargingStartStopAction_tag,            GetOnSet::GetChargeState,  0,  CommandPolicy::Action, true},
+            {BLE_CarServer_VehicleAction::SET_CHARGING_AMPS,                "setChargingAmps",           AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_setChargingAmpsAction_tag,              GetOnSet::GetChargeState,  0,  CommandPolicy::Action, true},
+            {BLE_CarServer_VehicleAction::SET_CHARGING_LIMIT,               "setChargingLimit",          AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_chargingSetLimitAction_tag,             GetOnSet::GetChargeState,  0,  CommandPolicy::Action, true},
+            {BLE_CarServer_VehicleAction::SET_SENTRY_SWITCH,                "setSentrySwitch",           AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_vehicleControlSetSentryModeAction_tag,  GetOnSet::Invalid,         0,  CommandPolicy::Action, true},
+            {BLE_CarServer_VehicleAction::SET_HVAC_SWITCH,                  "setHVACSwitch",             AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_hvacAutoAction_tag,                     GetOnSet::GetClimateState, 0,  CommandPolicy::Action, true},
+            {BLE_CarServer_VehicleAction::SET_HVAC_STEERING_HEATER_SWITCH,  "setHVACSteeringHeatSwitch", AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_hvacSteeringWheelHeaterAction_tag,      GetOnSet::Invalid,         0,  CommandPolicy::Action, true},
+            {BLE_CarServer_VehicleAction::SET_OPEN_CHARGE_PORT_DOOR,        "setOpenChargePortDoor",     AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_chargePortDoorOpen_tag,                 GetOnSet::Invalid,         0,  CommandPolicy::Action, false},
+            {BLE_CarServer_VehicleAction::SET_CLOSE_CHARGE_PORT_DOOR,       "setCloseChargePortDoor",    AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_chargePortDoorClose_tag,                GetOnSet::Invalid,         0,  CommandPolicy::Action, false},
+            {BLE_CarServer_VehicleAction::SOUND_HORN,                       "soundHorn",                 AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_vehicleControlHonkHornAction_tag,       GetOnSet::Invalid,         0,  CommandPolicy::Action, false},
+            {BLE_CarServer_VehicleAction::FLASH_LIGHT,                      "flashLight",                AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_vehicleControlFlashLightsAction_tag,    GetOnSet::Invalid,         0,  CommandPolicy::Action, false},
+            {BLE_CarServer_VehicleAction::SET_WINDOWS_SWITCH,               "setWindowsSwitch",          AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_vehicleControlWindowAction_tag,         GetOnSet::GetClosureState, 0,  CommandPolicy::Action, true},
+            {BLE_CarServer_VehicleAction::DEFROST_CAR,                      "defrostCar",                AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_hvacSetPreconditioningMaxAction_tag,    GetOnSet::GetClimateState, 0,  CommandPolicy::Action, true},
+            {BLE_CarServer_VehicleAction::SET_CLIMATE_TEMP,                 "setClimateTemp",            AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_hvacTemperatureAdjustmentAction_tag,    GetOnSet::GetClimateState, 0,  CommandPolicy::Action, true},
+            {BLE_CarServer_VehicleAction::MEDIA_PLAY,                       "mediaPlay",                 AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_mediaPlayAction_tag,                    GetOnSet::Invalid,         0,  CommandPolicy::Action, false},
+            {BLE_CarServer_VehicleAction::MEDIA_NEXT_TRACK,                 "mediaNextTrack",            AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_mediaNextTrack_tag,                     GetOnSet::Invalid,         0,  CommandPolicy::Action, false},
+            {BLE_CarServer_VehicleAction::MEDIA_PREVIOUS_TRACK,             "mediaPreviousTrack",        AllowedMsg::VehicleActionMessage,  CarServer_VehicleAction_mediaPreviousTrack_tag,                 GetOnSet::Invalid,         0,  CommandPolicy::Action, false}
         }};
         static_assert(ACTION_SPECIFICS.size() == static_cast<std::size_t>(BLE_CarServer_VehicleAction::_COUNT), "ACTION_SPECIFICS out of sync with enum");
+        inline constexpr uint32_t vehicle_data_bit (BLE_CarServer_VehicleAction action)
+        { // Bit for a get in the mask carried by a GET_VEHICLE_DATA command
+            return 1u << static_cast<uint32_t>(action);
+        }
+        static_assert(static_cast<std::size_t>(BLE_CarServer_VehicleAction::_COUNT) <= 32, "Get mask no longer fits in a command param");
         static const char *const TAG = "tesla_ble_vehicle";
         static const char *nvs_key_infotainment = "tk_infotainment";
         static const char *nvs_key_vcsec = "tk_vcsec";
@@ -136,11 +170,31 @@ namespace esphome
         static const int PRIVATE_KEY_SIZE = 228;
         static const int PUBLIC_KEY_SIZE = 65;
         static const int MAX_BLE_MESSAGE_SIZE = 4608; // Max size of a BLE message
-        static const int RX_TIMEOUT = 1 * 1000;       // Timeout interval between receiving chunks of a message (1s)
+        static const int RX_TIMEOUT = 1 * 1000;       // Default timeout interval between receiving chunks of a message (1s)
         static const int MAX_LATENCY = 4 * 1000;      // Max allowed error when syncing vehicle clock (4s)
-        static const int BLOCK_LENGTH = 20;           // BLE MTU is 23 bytes, so we need to split the message into chunks (20 bytes as in vehicle_command)
-        static const int MAX_RETRIES = 5;             // Max number of retries for a command
-        static const int COMMAND_TIMEOUT = 30 * 1000; // Overall timeout for a command (30s)
+        static const int BLOCK_LENGTH = 20;           // Default BLE MTU is 23 bytes, so we need to split the message into chunks (20 bytes as in vehicle_command)
+        static const int MAX_BLOCK_LENGTH = 512;      // Largest attribute value that can be written in one go
+        static const int ATT_HEADER_LENGTH = 3;       // Bytes of the ATT MTU used by the write opcode and handle
+        static const int PREFERRED_MTU = 517;         // ATT MTU asked for if the exchange on connect gave less, the car may agree to less
+        static const int MAX_LL_DATA_LENGTH = 251;    // Largest link layer payload with LE Data Length Extension (27 without)
+        static const int MAX_RETRIES = 5;             // Max number of retries for a session request or wake, commands follow COMMAND_POLICIES
+        static const int MAX_TX_CHUNKS_PER_LOOP = 32; // Upper bound on chunks handed to the BLE stack in one loop
+        static const int TX_BACKOFF_MIN = 20;         // Initial delay before retrying a failed chunk write (ms)
+        static const int TX_BACKOFF_MAX = 1000;       // Longest delay between retries of a failed chunk write (ms)
+        static const int TX_CONFIRM_TIMEOUT = 2 * 1000; // Time allowed for the car to confirm a chunk with reliable_writes (2s)
+        static const int MAX_TX_RETRANSMITS = 3;      // Times a message is sent again before giving up with reliable_writes
+        static const int MAX_IN_FLIGHT = 4;           // Default number of infotainment requests awaiting a response at once
+        static const int MAX_COMMAND_STEPS = 8;       // Most states the front command can pass through in one loop
+        static const int MIN_RESPONSE_TIMEOUT = 300;  // Shortest wait for a response however quickly the car has been answering (ms)
+        static const int MAX_RESPONSE_TIMEOUT = 16 * 1000; // Longest wait for a response, reached by backing off while the car is slow (16s)
+        static const int REQUEST_BURST = 4;           // Default number of requests that can go to a domain back to back
+        static constexpr float REQUEST_RATE = 2.0f;   // Default sustained requests per second to each domain
+        static constexpr float MIN_RATE_FRACTION = 0.125f; // Lowest share of the configured rate WAIT/BUSY responses can cut it to
+        static const int RATE_RECOVERY_TIME = 10 * 1000;   // Time to win back the whole configured rate after a cut (10s)
+        static const int WAKE_RESULT_VALIDITY = 10 * 1000; // How long the outcome of a wake is given to commands joining it (10s)
+        static constexpr float RETRY_JITTER = 0.5f;   // Most a resend is put back at random, as a share of the response timeout
+        static const int BREAKER_FAILURES = 3;        // Default number of commands in a row given up on unanswered before the breaker opens
+        static const int KEY_REJECTED_HOLD = 5 * 60 * 1000; // Time commands are held after the car rejects our key, unless paired first (5min)
 
         enum class BLECommandState
         {
@@ -156,48 +210,453 @@ namespace esphome
             WAITING_FOR_RESPONSE,
             WAITING_FOR_GET_POST_SET
         };
+        enum class BLECommandKind : uint8_t // What a queued command does, see COMMAND_SPECIFICS
+        {
+            WAKE,
+            LOCK,
+            UNLOCK,
+            DATA_UPDATE,        // VCSEC status poll
+            DATA_UPDATE_FORCED, // VCSEC status poll that also brings up infotainment
+            CLOSURE_MOVE,       // Opens or closes a trunk, door or the charge port, param holds what and how
+            CARSERVER_ACTION,   // Get or set described by ACTION_SPECIFICS
+            _COUNT
+        };
+        enum class StatusCompletion : uint8_t // What a VCSEC vehicle status means to an infotainment command awaiting a response
+        {
+            NEVER,
+            ALWAYS,
+            WHEN_AWAKE // Otherwise infotainment is asleep so needs authenticating again
+        };
+        struct CommandKindDetail
+        /*
+        *   Rows of the COMMAND_SPECIFICS table below, one for each BLECommandKind in the same order. This is what the command state
+        *   machine checks to decide how a command completes.
+        */
+        {
+            BLECommandKind kind;
+            const char* name;
+            BLECommandState sentState;     // State to wait in once the command has been sent
+            bool doneWhenAwake;            // Seeing the car awake completes it, rather than moving on to infotainment auth
+            StatusCompletion onStatus;
+            bool unlockedWhenDone;         // Only used while WAITING_FOR_LOCK_RESPONSE
+            CommandPolicy policy;          // CarServer commands take theirs from ACTION_SPECIFICS
+        };
+        static constexpr std::array<CommandKindDetail, 7> COMMAND_SPECIFICS
+        {{
+            {BLECommandKind::WAKE,               "wake vehicle",         BLECommandState::WAITING_FOR_WAKE_RESPONSE, true,  StatusCompletion::ALWAYS,     false, CommandPolicy::Action},
+            {BLECommandKind::LOCK,               "lock vehicle",         BLECommandState::WAITING_FOR_LOCK_RESPONSE, false, StatusCompletion::NEVER,      false, CommandPolicy::Action},
+            {BLECommandKind::UNLOCK,             "unlock vehicle",       BLECommandState::WAITING_FOR_LOCK_RESPONSE, false, StatusCompletion::NEVER,      true,  CommandPolicy::Action},
+            {BLECommandKind::DATA_UPDATE,        "data update",          BLECommandState::WAITING_FOR_RESPONSE,      false, StatusCompletion::ALWAYS,     false, CommandPolicy::Poll},
+            {BLECommandKind::DATA_UPDATE_FORCED, "data update | forced", BLECommandState::WAITING_FOR_RESPONSE,      false, StatusCompletion::WHEN_AWAKE, false, CommandPolicy::Action},
+            {BLECommandKind::CLOSURE_MOVE,       "closure move",         BLECommandState::WAITING_FOR_RESPONSE,      false, StatusCompletion::NEVER,      false, CommandPolicy::Action},
+            {BLECommandKind::CARSERVER_ACTION,   "",                     BLECommandState::WAITING_FOR_RESPONSE,      false, StatusCompletion::NEVER,      false, CommandPolicy::Action}
+        }};
+        static_assert(COMMAND_SPECIFICS.size() == static_cast<std::size_t>(BLECommandKind::_COUNT), "COMMAND_SPECIFICS out of sync with enum");
+        static_assert(COMMAND_POLICIES.size() == static_cast<std::size_t>(CommandPolicy::Action) + 1, "COMMAND_POLICIES out of sync with enum");
+        using BLECommandHandle = uint32_t; // Returned for each command asked for through the public entry points, 0 if none was queued
+        enum class BLECommandOutcome : uint8_t // How a command left the queue, reported to the on_command_* automations
+        {
+            SUCCESS,
+            FAILURE, // Given up after its retries, or dropped
+            TIMEOUT  // Still unfinished at its deadline
+        };
         struct BLECommand
         {
             UniversalMessage_Domain domain;
-            std::function<int()> execute;
-            std::string execute_name;
+            BLECommandKind kind;
             BLE_CarServer_VehicleAction action; // Only used for Infotainment domain to store the detailed request made
+            int32_t param;                      // Value sent with a CarServer set
             BLECommandState state;
-            uint32_t started_at = millis();
+            uint32_t queued_at = millis();
+            uint32_t started_at = queued_at;    // Reset once the command leaves the queue to be worked on
+            uint32_t deadline = queued_at;      // Dropped once this passes, set from its policy
             uint32_t last_tx_at = 0;
+            uint32_t retry_delay = 0;           // Wait after sending before it may be sent again, see retryDelay
             uint8_t retry_count = 0;
             int done_times = 0; // Used to count if something has been done and how many times
+            uint8_t sends = 0;  // Times its message has been sent, only the response to a single send gives a round trip time
+            uint8_t request_uuid[16] = {};  // UUID of the message last sent, the car echoes it in its response
+            bool has_request_uuid = false;
+            bool written = false;           // The message last sent has left the TX ring (see messageSent)
+            bool send_failed = false;       // The last attempt couldn't be sent, so the next waits retry_delay as a resend does
+            BLECommandHandle handle = 0;    // 0 if nothing waits on the outcome
+
+            BLECommand() = default;
+            BLECommand(UniversalMessage_Domain d, BLECommandKind k, BLE_CarServer_VehicleAction a = BLE_CarServer_VehicleAction::DO_NOTHING, int32_t p = 0)
+                : domain(d), kind(k), action(a), param(p), state(BLECommandState::IDLE) { deadline = queued_at + policy().deadline; }
 
-            BLECommand(UniversalMessage_Domain d, std::function<int()> e, std::string n = "", BLE_CarServer_VehicleAction a = BLE_CarServer_VehicleAction::DO_NOTHING)
-                : domain(d), execute(e), execute_name(n), action(a), state(BLECommandState::IDLE) {}
+            inline const CommandKindDetail& detail () const { return COMMAND_SPECIFICS[static_cast<size_t>(kind)]; }
+            inline const char* name () const
+            { // CarServer commands are named after their action
+                return (kind == BLECommandKind::CARSERVER_ACTION) ? ACTION_SPECIFICS[static_cast<size_t>(action)].action_str : detail().name;
+            }
+            inline const CommandPolicyDetail& policy () const
+            {
+                return COMMAND_POLICIES[static_cast<size_t>((kind == BLECommandKind::CARSERVER_ACTION) ? ACTION_SPECIFICS[static_cast<size_t>(action)].policy : detail().policy)];
+            }
+            inline bool expired (uint32_t now) const { return static_cast<int32_t>(now - deadline) > 0; }
+            inline void renew (uint32_t now)
+            { // A newer request merged into this one gets as long as if it had been queued now
+                queued_at = now;
+                started_at = now;
+                deadline = now + policy().deadline;
+            }
+            inline UniversalMessage_Domain lane () const
+            { // Commands needing infotainment, or waiting for it to come up like a wake, wait behind each other. VCSEC works while the car sleeps
+                return ((domain == UniversalMessage_Domain_DOMAIN_INFOTAINMENT) or (kind == BLECommandKind::WAKE)) ?
+                       UniversalMessage_Domain_DOMAIN_INFOTAINMENT : UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY;
+            }
+            inline UniversalMessage_Domain sends_to () const
+            { // Domain its own message goes to, all but CarServer commands send VCSEC messages
+                return (kind == BLECommandKind::CARSERVER_ACTION) ? UniversalMessage_Domain_DOMAIN_INFOTAINMENT : UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY;
+            }
+            inline bool is_get () const
+            {
+                return (kind == BLECommandKind::CARSERVER_ACTION) and (ACTION_SPECIFICS[static_cast<size_t>(action)].whichMsg == AllowedMsg::GetVehicleDataMessage);
+            }
+            inline bool preemptible () const
+            { // Background reads, which a user action can put back in the queue once started
+                return is_get() or (kind == BLECommandKind::DATA_UPDATE);
+            }
+            inline bool probe () const
+            { // The VCSEC status poll, cheap enough to keep trying while the car isn't answering anything else
+                return kind == BLECommandKind::DATA_UPDATE;
+            }
         };
-        struct BLETXChunk
+        static_assert(std::is_trivially_copyable<BLECommand>::value, "BLECommand must stay cheap to copy");
+        // Commands of each lane are worked on one after another, but the lanes go ahead side by side
+        static constexpr std::array<UniversalMessage_Domain, 2> COMMAND_LANES
+        {{
+            UniversalMessage_Domain_DOMAIN_VEHICLE_SECURITY,
+            UniversalMessage_Domain_DOMAIN_INFOTAINMENT
+        }};
+        class BLERTTEstimator
+        /*
+        *   Smoothed round trip time of one domain and how much it varies, worked out as TCP does (RFC 6298). The response
+        *   timeout follows them between MIN_RESPONSE_TIMEOUT and MAX_RESPONSE_TIMEOUT, starting at MAX_LATENCY until a round
+        *   trip has been measured. Each timeout doubles it until the next measurement, once however many requests timed out
+        *   together: another doubling waits until the doubled timeout has passed since the last.
+        */
         {
-            std::vector<unsigned char> data;
+        public:
+            void sample (uint32_t rtt);
+            bool back_off (uint32_t now);
+            void reset ();
+            inline uint32_t srtt () const { return srtt_; }
+            inline uint32_t timeout () const { return timeout_; }
+
+        protected:
+            bool measured_ = false;
+            uint32_t srtt_ = 0;
+            uint32_t rttvar_ = 0;
+            uint32_t timeout_ = MAX_LATENCY;
+            bool backed_off_ = false;
+            uint32_t backed_off_at_ = 0;
+        };
+        enum class WakeStatus : uint8_t
+        {
+            IDLE,   // No wake under way, or its outcome is too old to go by
+            WAKING,
+            AWAKE,
+            FAILED  // Gave up after MAX_RETRIES attempts
+        };
+        struct BLEWakeOperation
+        /*
+        *   The one wake of the car that every command needing it awake waits on, so a queue of infotainment commands sends one
+        *   series of wakes between them. Its outcome holds for WAKE_RESULT_VALIDITY, so commands reaching it just after a failure
+        *   fail too rather than starting again.
+        */
+        {
+            WakeStatus status = WakeStatus::IDLE;
+            uint8_t attempts = 0;      // Wakes and status polls sent so far
+            uint32_t last_tx_at = 0;
+            uint8_t request_uuid[16] = {}; // UUID of the message last sent
+            bool has_request_uuid = false;
+            bool written = false;      // The message last sent has left the TX ring
+            bool refreshing_session = false; // The last attempt asked for a new VCSEC session rather than waking
+            uint32_t finished_at = 0;
+        };
+        class BLETokenBucket
+        /*
+        *   Limits how fast requests go to one domain. Up to burst tokens are held, refilled at the current rate, and each request
+        *   takes one once it has been queued to send, so one that couldn't be sent costs nothing. A WAIT or BUSY from the car
+        *   halves the rate (down to MIN_RATE_FRACTION of the configured one) and empties the bucket, then the rate climbs back
+        *   steadily over RATE_RECOVERY_TIME.
+        */
+        {
+        public:
+            void configure (float rate, uint8_t burst);
+            bool available (uint32_t now);
+            void take ();
+            void throttle (uint32_t now);
+            inline float rate () const { return rate_; }
+
+        protected:
+            void refill (uint32_t now);
+            float max_rate_ = REQUEST_RATE;
+            float rate_ = REQUEST_RATE;
+            float burst_ = REQUEST_BURST;
+            float tokens_ = REQUEST_BURST;
+            uint32_t refilled_at_ = 0;
+        };
+        enum class BreakerState : uint8_t
+        {
+            CLOSED,      // Commands run as normal
+            OPEN,        // The car stopped answering, only probes are sent until one is answered
+            KEY_REJECTED // The car doesn't know our key, nothing is sent until pairing or KEY_REJECTED_HOLD has passed
+        };
+        class BLECircuitBreaker
+        /*
+        *   Stops airtime going on retries the car won't answer. It opens once threshold commands in a row have been given up on
+        *   without an answer, or at once if the car rejects our key, and only commands it allows are then worked on.
+        */
+        {
+        public:
+            inline void configure (uint8_t threshold) { threshold_ = threshold; }
+            bool unanswered ();
+            bool answered ();
+            bool reject_key (uint32_t now);
+            bool update (uint32_t now);
+            void close ();
+            inline BreakerState state () const { return state_; }
+            inline bool open () const { return state_ != BreakerState::CLOSED; }
+            inline bool allows (const BLECommand &command) const
+            {
+                return (state_ == BreakerState::CLOSED) or ((state_ == BreakerState::OPEN) and command.probe());
+            }
+
+        protected:
+            BreakerState state_ = BreakerState::CLOSED;
+            uint8_t threshold_ = BREAKER_FAILURES;
+            uint8_t failures_ = 0;   // Commands given up on unanswered since the car last answered
+            uint32_t opened_at_ = 0;
+        };
+        static constexpr size_t COMMAND_QUEUE_SIZE = 32; // Max number of commands waiting
+        class BLECommandQueue
+        /*
+        *   Fixed capacity double ended queue of commands, so inserting at either end is O(1). Inserting or erasing part way along
+        *   copies every command between there and the nearer end, O(min(index, size - index)), which only happens when a command
+        *   goes behind one in progress or leaves from the middle. Each lane (see COMMAND_LANES) runs its oldest command, edited
+        *   in place, independently of the other. Infotainment commands behind that one may be in flight too (see
+        *   process_pipelined_commands).
+        */
+        {
+        public:
+            bool push (const BLECommand &command);
+            bool push_front (const BLECommand &command);
+            bool insert (size_t index, const BLECommand &command);
+            int head (UniversalMessage_Domain lane);
+            void pop ();
+            void pop_back ();
+            void erase (size_t index);
+            BLECommand *find_waiting (BLECommandKind kind, BLE_CarServer_VehicleAction action);
+            int find_request (const uint8_t *request_uuid, size_t uuid_length, UniversalMessage_Domain domain);
+            inline bool empty () const { return count_ == 0; }
+            inline bool full () const { return count_ == commands_.size(); }
+            inline size_t size () const { return count_; }
+            inline BLECommand &front () { return commands_[head_]; }
+            inline BLECommand &back () { return at(count_ - 1); }
+            inline BLECommand &at (size_t index) { return commands_[(head_ + index) % commands_.size()]; }
+
+        protected:
+            std::array<BLECommand, COMMAND_QUEUE_SIZE> commands_{};
+            size_t head_ = 0;
+            size_t count_ = 0;
+        };
+        /*
+        *   The TX ring holds whole encoded messages back to back. Messages are built directly into space reserved in the ring
+        *   and are then sent in chunks straight from there, so nothing on the write path allocates or copies.
+        */
+        static constexpr size_t TX_RING_SIZE = std::max(static_cast<size_t>(MAX_BLE_MESSAGE_SIZE), 2 * static_cast<size_t>(UniversalMessage_RoutableMessage_size));
+        static constexpr size_t TX_RING_MESSAGES = 16; // Max number of messages waiting to be sent
+        enum class BLETXPriority : uint8_t // TX lanes, a waiting CONTROL message is always sent before any NORMAL one
+        {
+            CONTROL, // Session info requests, wakes and VCSEC information requests
+            NORMAL
+        };
+        struct BLETXMessage
+        {
+            size_t offset = 0; // Start of the encoded message in the ring
+            size_t length = 0;
+            size_t sent = 0;   // Number of bytes already handed to the BLE stack
+            esp_gatt_write_type_t write_type = ESP_GATT_WRITE_TYPE_NO_RSP;
+            esp_gatt_auth_req_t auth_req = ESP_GATT_AUTH_REQ_NONE;
+            BLETXPriority priority = BLETXPriority::NORMAL;
+            bool done = false; // Fully sent, its space is released once all older messages are done too
+            uint32_t sent_at = 0;     // When the last chunk was handed to the BLE stack
+            uint8_t retry_count = 0;  // Number of times the message has been sent again from the start
+        };
+        struct BLETXChunk // A view onto the next piece of the message being sent
+        {
+            unsigned char *data;
+            size_t length;
             esp_gatt_write_type_t write_type;
             esp_gatt_auth_req_t auth_req;
-            uint32_t sent_at = millis();
-            uint8_t retry_count = 0;
+            const unsigned char *message; // The whole message the chunk is from
+            size_t message_length;
+        };
+        class BLETXRing
+        {
+        public:
+            unsigned char *reserve (size_t length);
+            bool commit (const unsigned char *data, size_t length, esp_gatt_write_type_t write_type, esp_gatt_auth_req_t auth_req,
+                         BLETXPriority priority = BLETXPriority::NORMAL);
+            BLETXChunk next_chunk (size_t chunk_size);
+            bool consume (size_t length);
+            void clear ();
+            uint8_t rewind ();
+            void drop ();
+            void mark_sent (uint32_t now);
+            uint32_t sent_at ();
+            inline bool contains (const unsigned char *data) const { return (data >= buffer_) and (data < buffer_ + TX_RING_SIZE); }
+            inline bool empty () const { return pending_ == 0; }
+            inline size_t size () const { return pending_; }
+
+        protected:
+            static constexpr size_t NO_MESSAGE = TX_RING_MESSAGES;
+            size_t select_next ();
+            void release_done ();
+
+            unsigned char buffer_[TX_RING_SIZE];
+            std::array<BLETXMessage, TX_RING_MESSAGES> messages_{};
+            size_t head_ = 0;       // Index of the oldest message in messages_
+            size_t count_ = 0;      // Number of messages holding space in the ring, sent or not
+            size_t pending_ = 0;    // Number of messages not yet fully sent
+            size_t active_ = NO_MESSAGE; // Message part way through being sent, it is finished before any other starts
+            size_t data_head_ = 0;  // Offset of the oldest message in buffer_
+            size_t data_tail_ = 0;  // Offset just beyond the newest message in buffer_
+        };
+        template <typename T, size_t N>
+        class SPSCRing
+        /*
+        *   Lock free queue for handing items from the Bluetooth host task to the ESPHome loop. Only one task may push and only
+        *   one may call front/pop, then neither ever waits for the other.
+        */
+        {
+        public:
+            bool push (const T &item)
+            {
+                size_t tail = tail_.load(std::memory_order_relaxed);
+                size_t next = (tail + 1) % items_.size();
+                if (next == head_.load(std::memory_order_acquire))
+                {
+                    return false;
+                }
+                items_[tail] = item;
+                tail_.store(next, std::memory_order_release);
+                return true;
+            }
+            bool front (T &item) const
+            {
+                size_t head = head_.load(std::memory_order_relaxed);
+                if (head == tail_.load(std::memory_order_acquire))
+                {
+                    return false;
+                }
+                item = items_[head];
+                return true;
+            }
+            void pop ()
+            {
+                head_.store((head_.load(std::memory_order_relaxed) + 1) % items_.size(), std::memory_order_release);
+            }
+            inline bool empty () const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
 
-            BLETXChunk(std::vector<unsigned char> d, esp_gatt_write_type_t wt, esp_gatt_auth_req_t ar)
-                : data(d), write_type(wt), auth_req(ar) {}
+        protected:
+            std::array<T, N + 1> items_{}; // One slot is always left empty to tell full from empty
+            std::atomic<size_t> head_{0};
+            std::atomic<size_t> tail_{0};
+        };
+        /*
+        *   Notifications are reassembled straight into a preallocated ring from the Bluetooth host task. Each message is kept
+        *   contiguous so it can be parsed in place. The host task hands completed messages to the loop by moving on a count
+        *   of completed bytes, so however many are waiting none is lost for want of a slot, and the loop finds each one from
+        *   its length prefix. The loop hands the space back once a message is parsed.
+        */
+        static constexpr size_t RX_RING_SIZE = 2 * MAX_BLE_MESSAGE_SIZE; // Room for a largest message wherever the last one ended
+        struct BLERXFrame
+        {
+            size_t offset = 0; // Start of the message, including its 2 byte length prefix, in the ring
+            size_t length = 0; // Length including the prefix
+            size_t skip = 0;   // Unused bytes at the end of the ring before the message, released with it
         };
-        struct BLERXChunk
+        class BLERXRing
         {
-            std::vector<unsigned char> buffer;
-            uint32_t received_at = millis();
+        public:
+            // Bluetooth host task
+            bool append (const unsigned char *data, size_t length, uint32_t now);
+            void reset ();
+            // ESPHome loop
+            bool front (BLERXFrame &frame) const;
+            void release ();
+            void discard_stale ();
+            inline const unsigned char *data (const BLERXFrame &frame) const { return buffer_ + frame.offset; }
+            inline uint32_t dropped () const { return dropped_.load(std::memory_order_relaxed); }
+            inline void set_timeout (uint32_t timeout) { timeout_ = timeout; }
+
+        protected:
+            bool reserve (size_t length);
+            void drop ();
+            inline size_t used () const { return written_ - released_.load(std::memory_order_acquire); }
 
-            BLERXChunk(std::vector<unsigned char> b)
-                : buffer(b) {}
+            unsigned char buffer_[RX_RING_SIZE];
+            // Only touched by the Bluetooth host task
+            size_t written_ = 0;       // Total bytes ever taken, the message being reassembled starts at written_ % RX_RING_SIZE
+            size_t partial_ = 0;       // Bytes of the message being reassembled
+            size_t frame_length_ = 0;  // Its length including the prefix, 0 until the prefix has arrived
+            bool resyncing_ = false;   // Looking for a plausible length prefix after a bad one
+            uint32_t partial_at_ = 0;  // When data was last added to the message being reassembled
+            uint32_t timeout_ = RX_TIMEOUT; // Longest gap allowed between chunks of a message
+            // Shared
+            std::atomic<size_t> completed_{0}; // Total bytes ever taken by complete messages, and skipped before them
+            std::atomic<size_t> stale_{0};     // completed_ at the last disconnect, messages before it belong to the old connection
+            std::atomic<size_t> released_{0}; // Total bytes ever handed back by the loop
+            std::atomic<uint32_t> dropped_{0}; // Number of incomplete or unrecognisable messages thrown away
+        };
+        enum class BLEGattEventType : uint8_t // GATT and GAP events that change TX state or sensors, applied in the loop
+        {
+            MTU,              // value is the negotiated MTU, 0 if the exchange failed
+            WRITE_CONFIRMED,  // Only queued with reliable_writes, when a chunk is awaited
+            WRITE_FAILED,
+            CONNECTED,
+            CLOSED,
+            PHY,              // value is the TX PHY the link moved to
+            DATA_LENGTH       // value is the link layer TX payload agreed
+        };
+        struct BLEGattEvent
+        {
+            BLEGattEventType type = BLEGattEventType::MTU;
+            uint16_t value = 0;
         };
+        // Room for a confirmation of every chunk one loop can send, and then some. Congestion and disconnection are flags
+        // rather than events, so neither can be lost if this ever fills
+        static constexpr size_t GATT_EVENT_SLOTS = MAX_TX_CHUNKS_PER_LOOP + 8;
+        /*
+        *   Decoded messages are large, so they are decoded straight into one of a few fixed slots and handled from there by
+        *   reference. A slot is only reused once its message has been handled.
+        */
+        static constexpr size_t RESPONSE_SLOTS = 4; // Max number of decoded messages waiting to be handled
         struct BLEResponse
         {
             // universal message
             UniversalMessage_RoutableMessage message;
-            uint32_t received_at = millis();
+            uint32_t received_at = 0; // When the loop took it from the RX ring
+        };
+        class BLEResponseQueue
+        {
+        public:
+            inline bool empty () const { return count_ == 0; }
+            inline bool full () const { return count_ == slots_.size(); }
+            inline BLEResponse &front () { return slots_[head_]; }
+            inline BLEResponse &back () { return slots_[(head_ + count_) % slots_.size()]; } // The free slot to decode into
+            inline void push () { count_++; }
+            inline void pop () { head_ = (head_ + 1) % slots_.size(); count_--; }
+            inline void clear () { head_ = 0; count_ = 0; }
 
-            BLEResponse(UniversalMessage_RoutableMessage m)
-                : message(m) {}
+        protected:
+            std::array<BLEResponse, RESPONSE_SLOTS> slots_{};
+            size_t head_ = 0;
+            size_t count_ = 0;
         };
         typedef enum // connected, disconnected, disconnected and Unknowns have been set
         {
@@ -229,6 +688,7 @@ namespace esphome
             ChargingState,
             ChargePortLatchState,
             LastUpdate,
+            BleCircuitBreaker,
             Count
         };
         enum class NumericSensorId : uint8_t {
@@ -253,6 +713,18 @@ namespace esphome
             ChargerPhases,
             ChargeRate,
             DriverTemp,
+            BleMtu,
+            BlePhy,
+            BleDataLength,
+            BleRetransmits,
+            BleWritesAbandoned,
+            BleRxDropped,
+            BleVcsecRtt,
+            BleInfotainmentRtt,
+            BleVcsecTimeout,
+            BleInfotainmentTimeout,
+            BleThrottleEvents,
+            BleCommandsDropped,
             Count
         };
 
@@ -277,11 +749,7 @@ namespace esphome
             int ble_disconnected_min_time_;
             int fast_poll_if_unlocked_ = 1; // != 0 enables fast polling
             int number_updates_since_connection_ = 0;
-            UniversalMessage_RoutableMessage read_queue_message_;
             CarServer_Response static_carserver_response_;
-            unsigned char static_message_buffer_[UniversalMessage_RoutableMessage_size];
-            //BLETXChunk static_tx_chunk_;
-            //BLERXChunk static_rx_chunk_;
 
             TeslaBLEVehicle();
             void setup() override;
@@ -289,6 +757,7 @@ namespace esphome
             void update() override;
             void gattc_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
                                      esp_ble_gattc_cb_param_t *param) override;
+            void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) override;
             void dump_config() override;
             void set_vin(const char *vin);
             void load_polling_parameters (const int post_wake_poll_time, const int poll_data_period,
@@ -296,10 +765,44 @@ namespace esphome
                                           const int ble_disconnected_min_time, const int fast_poll_if_unlocked,
                                           const int wake_on_boot);
             void process_command_queue();
+            bool advance_command(UniversalMessage_Domain lane);
+            void process_pipelined_commands();
+            void process_wake();
+            void requestWake(uint32_t now);
+            WakeStatus wakeStatus(uint32_t now) const;
             void process_response_queue();
             void process_ble_read_queue();
             void process_ble_write_queue();
+            void process_gatt_events();
+            void pushGattEvent(BLEGattEventType type, uint16_t value = 0);
             void invalidateSession(UniversalMessage_Domain domain);
+            void setChunkSizeFromMTU(uint16_t mtu);
+            void requestLinkUpgrade();
+            void set_prefer_2m_phy(bool prefer_2m_phy) { prefer_2m_phy_ = prefer_2m_phy; }
+            void set_data_length_extension(bool data_length_extension) { data_length_extension_ = data_length_extension; }
+            void set_reliable_writes(bool reliable_writes) { reliable_writes_ = reliable_writes; }
+            void set_rx_timeout(uint32_t rx_timeout) { ble_rx_ring_.set_timeout(rx_timeout); }
+            void retransmitBLE();
+            void set_max_in_flight(int max_in_flight) { max_in_flight_ = max_in_flight; }
+            void set_request_rate(float rate, int burst)
+            {
+                vcsec_bucket_.configure(rate, burst);
+                infotainment_bucket_.configure(rate, burst);
+            }
+            void set_breaker_failures(int failures) { breaker_.configure(failures); }
+            // Called with the command's handle, its name, how long it waited in the queue and how long it then took (ms)
+            void add_on_command_success_callback(std::function<void(BLECommandHandle, std::string, uint32_t, uint32_t)> &&callback)
+            {
+                command_success_callback_.add(std::move(callback));
+            }
+            void add_on_command_failure_callback(std::function<void(BLECommandHandle, std::string, uint32_t, uint32_t)> &&callback)
+            {
+                command_failure_callback_.add(std::move(callback));
+            }
+            void add_on_command_timeout_callback(std::function<void(BLECommandHandle, std::string, uint32_t, uint32_t)> &&callback)
+            {
+                command_timeout_callback_.add(std::move(callback));
+            }
 
             void regenerateKey();
             int startPair(void);
@@ -309,22 +812,54 @@ namespace esphome
 
             int handleInfoCarServerResponse (const CarServer_Response& carserver_response);
             int handleSessionInfoUpdate(const UniversalMessage_RoutableMessage& message, UniversalMessage_Domain domain);
-            int handleVCSECVehicleStatus(VCSEC_VehicleStatus vehicleStatus);
+            int handleVCSECVehicleStatus(const VCSEC_VehicleStatus &vehicleStatus);
+            void handleResponse(UniversalMessage_RoutableMessage &message);
 
-            int wakeVehicle(void);
-            int lockVehicle (VCSEC_RKEAction_E lock);
-            void placeAtFrontOfQueue (UniversalMessage_Domain domain, std::function<int()> execute, std::string execute_name, BLE_CarServer_VehicleAction action = BLE_CarServer_VehicleAction::DO_NOTHING);
+            BLECommandHandle wakeVehicle(void);
+            BLECommandHandle lockVehicle (VCSEC_RKEAction_E lock);
+            BLECommandHandle assignHandle (BLECommand &command);
+            void placeAtFrontOfQueue (const BLECommand &command);
+            void placeProbe (const BLECommand &command);
+            void suspendCommand (size_t index);
+            void finishCommand (size_t index, BLECommandOutcome outcome);
+            void dropCommand (size_t index, BLECommandOutcome outcome);
+            void expireCommands ();
+            void reportCommand (BLECommand &command, BLECommandOutcome outcome);
+            int executeCommand (const BLECommand &command);
+            void commandSent (BLECommand &command, uint32_t now);
+            void commandSendFailed (BLECommand &command, uint32_t now);
+            void noteRequestUUID (BLECommand &command);
+            void messageSent (const unsigned char *message, size_t length);
+            void requestGetOnSet (BLE_CarServer_VehicleAction action);
+            BLERTTEstimator &rtt (UniversalMessage_Domain domain);
+            void commandAnswered (const BLECommand &command, UniversalMessage_Domain domain);
+            void sampleRTT (UniversalMessage_Domain domain, uint32_t round_trip);
+            void backOffResponseTimeout (UniversalMessage_Domain domain);
+            inline uint32_t responseTimeout (UniversalMessage_Domain domain) { return rtt(domain).timeout(); }
+            uint32_t retryDelay (UniversalMessage_Domain domain);
+            void noteUnanswered (bool written);
+            void noteAnswered ();
+            void publishBreakerState ();
+            BLETokenBucket &bucket (UniversalMessage_Domain domain);
+            bool mayRequest (UniversalMessage_Domain domain, const BLECommand &command, uint32_t now);
+            void carBusy (UniversalMessage_Domain domain, int index);
+            int executeCarServerAction (BLE_CarServer_VehicleAction action, int32_t param);
+            int buildGetVehicleDataMessage (uint32_t categories, unsigned char *message_buffer, size_t *message_length);
     
             int sendVCSECActionMessage(VCSEC_RKEAction_E action);
-            int sendVCSECClosureMoveRequestMessage (int moveWhat, VCSEC_ClosureMoveType_E moveType);
-            int sendCarServerVehicleActionMessage(BLE_CarServer_VehicleAction action, int param);
+            BLECommandHandle sendVCSECClosureMoveRequestMessage (int moveWhat, VCSEC_ClosureMoveType_E moveType);
+            int executeClosureMove (int moveWhat, VCSEC_ClosureMoveType_E moveType);
+            BLECommandHandle sendCarServerVehicleActionMessage(BLE_CarServer_VehicleAction action, int param);
+            int requestVehicleData (uint32_t categories);
             int sendSessionInfoRequest(UniversalMessage_Domain domain);
             int sendVCSECInformationRequest(void);
             void enqueueVCSECInformationRequest(bool force = false);
             int wake_on_boot_ = 0; // != 0 wakes car on device boot
 
+            unsigned char *reserveBLE(void);
             int writeBLE(const unsigned char *message_buffer, size_t message_length,
-                         esp_gatt_write_type_t write_type, esp_gatt_auth_req_t auth_req);
+                         esp_gatt_write_type_t write_type, esp_gatt_auth_req_t auth_req,
+                         BLETXPriority priority = BLETXPriority::NORMAL);
 
             inline const ActionMessageDetail& get_action_detail (BLE_CarServer_VehicleAction action)
             { // Get the entry in the ACTION_SPECIFICS table corresponding to the action (we can't be sure of the order)
@@ -432,10 +967,41 @@ namespace esphome
             }
 
         protected:
-            std::queue<BLERXChunk> ble_read_queue_;
-            std::queue<BLEResponse> response_queue_;
-            std::queue<BLETXChunk> ble_write_queue_;
-            std::queue<BLECommand> command_queue_;
+            BLERXRing ble_rx_ring_;
+            SPSCRing<BLEGattEvent, GATT_EVENT_SLOTS> gatt_events_;
+            uint32_t ble_rx_dropped_published_ = 0;
+            BLEResponseQueue response_queue_;
+            BLETXRing ble_tx_ring_;
+            std::atomic<bool> ble_tx_congested_{false}; // Set while the BLE stack reports the link as congested, only written by it
+            std::atomic<bool> ble_disconnect_pending_{false}; // Set by the BLE stack on disconnect until the loop has reset TX state
+            uint16_t ble_chunk_size_ = BLOCK_LENGTH; // Size of each chunk written, follows the negotiated ATT MTU
+            uint16_t ble_negotiated_mtu_ = BLOCK_LENGTH + ATT_HEADER_LENGTH; // ATT MTU as last reported, only used by gattc_event_handler
+            bool prefer_2m_phy_ = false;         // Ask for the 2M PHY once connected (BLE 5 chips only)
+            bool data_length_extension_ = false; // Ask for the maximum link layer payload once connected
+            std::atomic<bool> data_length_requested_{false}; // Our request is outstanding, the outcome doesn't say which link it was for
+            uint32_t ble_tx_backoff_ = 0;   // Current delay after a failed chunk write, 0 when the last write succeeded
+            uint32_t ble_tx_failed_at_ = 0;
+            bool reliable_writes_ = false;  // Write with response and confirm each chunk before sending the next
+            size_t ble_tx_awaiting_ = 0;    // Length of the chunk waiting to be confirmed, 0 if none
+            uint32_t ble_tx_retransmits_ = 0;
+            uint32_t ble_tx_abandoned_ = 0;
+            BLECommandQueue command_queue_;
+            int max_in_flight_ = MAX_IN_FLIGHT; // 1 keeps to one command at a time
+            uint8_t ble_tx_uuid_[16] = {};      // UUID of the last message written, copied to the command that sent it
+            BLERTTEstimator vcsec_rtt_;
+            BLERTTEstimator infotainment_rtt_;
+            bool ble_tx_has_uuid_ = false;
+            bool ble_tx_full_ = false;          // The last message couldn't be queued for lack of room in the TX ring
+            BLECommandHandle next_command_handle_ = 1;
+            BLEWakeOperation wake_;
+            BLETokenBucket vcsec_bucket_;
+            BLETokenBucket infotainment_bucket_;
+            BLECircuitBreaker breaker_;
+            uint32_t throttle_events_ = 0;  // WAIT/BUSY responses that cut a domain's request rate
+            uint32_t commands_dropped_ = 0; // Commands that ran out of time or were pushed out of the queue
+            CallbackManager<void(BLECommandHandle, std::string, uint32_t, uint32_t)> command_success_callback_;
+            CallbackManager<void(BLECommandHandle, std::string, uint32_t, uint32_t)> command_failure_callback_;
+            CallbackManager<void(BLECommandHandle, std::string, uint32_t, uint32_t)> command_timeout_callback_;
 
             TeslaBLE::Client *tesla_ble_client_;
             uint32_t storage_handle_;
@@ -454,8 +1020,6 @@ namespace esphome
 
             std::array<sensor::Sensor*, static_cast<size_t>(NumericSensorId::Count)> numeric_sensors_{};
 
-            std::vector<unsigned char> ble_read_buffer_;
-
             void initializeFlash();
             void openNVSHandle();
             void initializePrivateKey();
@@ -463,5 +1027,35 @@ namespace esphome
             void loadDomainSessionInfo(UniversalMessage_Domain domain);
         };
 
+        class CommandSuccessTrigger : public Trigger<BLECommandHandle, std::string, uint32_t, uint32_t>
+        {
+        public:
+            explicit CommandSuccessTrigger(TeslaBLEVehicle *parent)
+            {
+                parent->add_on_command_success_callback([this](BLECommandHandle handle, std::string action, uint32_t queue_wait, uint32_t latency)
+                                                       { this->trigger(handle, action, queue_wait, latency); });
+            }
+        };
+
+        class CommandFailureTrigger : public Trigger<BLECommandHandle, std::string, uint32_t, uint32_t>
+        {
+        public:
+            explicit CommandFailureTrigger(TeslaBLEVehicle *parent)
+            {
+                parent->add_on_command_failure_callback([this](BLECommandHandle handle, std::string action, uint32_t queue_wait, uint32_t latency)
+                                                       { this->trigger(handle, action, queue_wait, latency); });
+            }
+        };
+
+        class CommandTimeoutTrigger : public Trigger<BLECommandHandle, std::string, uint32_t, uint32_t>
+        {
+        public:
+            explicit CommandTimeoutTrigger(TeslaBLEVehicle *parent)
+            {
+                parent->add_on_command_timeout_callback([this](BLECommandHandle handle, std::string action, uint32_t queue_wait, uint32_t latency)
+                                                       { this->trigger(handle, action, queue_wait, latency); });
+            }
+        };
+
     } // namespace tesla_ble_vehicle
 } // namespace esphome